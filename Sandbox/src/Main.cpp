@@ -21,7 +21,7 @@ void check_result(sourdo::Data& data, sourdo::Result res)
     }
 }
 
-int main()
+int main(int argc, char** argv)
 {
     sourdo::Data test;
 
@@ -30,13 +30,26 @@ int main()
 
     auto begin = std::chrono::high_resolution_clock::now();
 
-    sourdo::Result res = test.do_file("Scripts/Main.sourdo");
+    // A script can be given on the command line, e.g. one of the benchmarks in 'Scripts/Benchmarks'
+    const char* script = argc > 1 ? argv[1] : "Scripts/Main.sourdo";
+    sourdo::Result res = test.do_file(script);
 
     auto end = std::chrono::high_resolution_clock::now();
     check_result(test, res);
 
     auto duration = std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(end - begin);
     std::cout << "SourDo script took " << duration.count() << " milliseconds" << std::endl;
+
+    sourdo::GCPauseHistogram pauses = test.get_gc_pause_histogram();
+    std::cout << "The garbage collector paused " << pauses.pause_count << " times for " << pauses.total_ms 
+        << " milliseconds, the longest pause took " << pauses.max_ms << " milliseconds" << std::endl;
+    for(size_t i = 0; i < pauses.buckets.size(); i++)
+    {
+        if(pauses.buckets[i] != 0)
+        {
+            std::cout << "    under " << (uint64_t(1) << i) << " us: " << pauses.buckets[i] << std::endl;
+        }
+    }
     
     return 0;
 }
@@ -3,6 +3,8 @@
 #include <string>
 #include <functional>
 #include <exception>
+#include <array>
+#include <cstdint>
 
 namespace sourdo
 {
@@ -33,8 +35,34 @@ namespace sourdo
 
     using Number = double;
     using CppFunction = bool(*)(Data&);
-    using GCRef = int;
+    // Called with the memory of a CppObject after it has been collected.
+    using CppObjectFinalizer = void(*)(void* block);
+    // The slot of a ref in its low 32 bits and the generation of the slot above them. Negative refs are invalid.
+    using GCRef = int64_t;
     struct SourDoFunction;
+
+    /**
+     * @brief How long the garbage collector has paused the program for. Bucket 'i' counts the pauses that took less than 
+     * 2^i microseconds and at least half of that, except for the last bucket which also counts every longer pause.
+     */
+    struct GCPauseHistogram
+    {
+        static constexpr size_t BUCKET_COUNT = 20;
+
+        std::array<uint64_t, BUCKET_COUNT> buckets = {};
+        uint64_t pause_count = 0;
+        double total_ms = 0;
+        double max_ms = 0;
+    };
+    
+    /**
+     * @brief How often the property reads and writes on objects found what they refer to in the inline cache of their instruction.
+     */
+    struct InlineCacheStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
     
     /**
      * @brief Represents and holds the data of a scope in a SourDo Program. 
@@ -52,14 +80,46 @@ namespace sourdo
         Result do_string(const std::string& string);
         Result do_file(const std::string& file_path);
 
-        void* create_cpp_object(size_t size);
+        /**
+         * @brief Pushes onto the stack a new CppObject and returns its memory, which is 'size' bytes long.
+         * 
+         * @param finalizer Called with the memory once the object is garbage. Collections only queue it,
+         * it runs in run_finalizers(), or when the state is destroyed.
+         */
+        void* create_cpp_object(size_t size, CppObjectFinalizer finalizer = nullptr);
         void* check_cpp_object(int index, const std::string& name);
         void* test_cpp_object(int index, const std::string& name);
         void set_cpp_object_type(int index, const std::string& name);
 
+        /**
+         * @brief Keeps the object or function at the given index alive until the returned ref is removed.
+         * 
+         * @returns The new ref, or -1 if the value isn't an object or a function.
+         */
         GCRef create_ref(int index);
+
+        /**
+         * @brief Like create_ref(), but the ref doesn't keep the value alive. Once the value is collected,
+         * the ref stays valid and push_ref() pushes null.
+         */
+        GCRef create_weak_ref(int index);
+
+        /**
+         * @brief Lets the value of the ref be collected. Its slot is reused by later refs, which invalidates the ref.
+         * Removing a ref that is no longer valid does nothing.
+         */
         void remove_ref(GCRef ref);
+
+        /**
+         * @brief Pushes onto the stack the value of the ref.
+         * 
+         * @throws SourDoError Thrown if the ref is not valid.
+         */
         void push_ref(GCRef ref);
+
+        /**
+         * @brief Returns true if the ref was created by this state and hasn't been removed.
+         */
         bool is_ref_valid(GCRef ref);
 
         /**
@@ -67,6 +127,15 @@ namespace sourdo
          */
         void create_table();
 
+        /**
+         * @brief Makes the table at the given index hold its keys, its values, or both weakly. The collector removes the
+         * entries whose weak key or value is only reachable through weak tables and weak refs. The value of a weak key is
+         * kept for as long as its key is. Strings, numbers and booleans are never removed.
+         * 
+         * @throws SourDoError Thrown if the value at the given index is not a table.
+         */
+        void set_table_weakness(int index, bool weak_keys, bool weak_values);
+
         /**
          * @brief Pushes onto the stack the value at the given key in the table. 
          * The new value is the value on the top of the stack, and
@@ -155,6 +224,13 @@ namespace sourdo
          */
         Result call_function(uint32_t arg_count, bool protected_mode_enabled = false);
 
+        /**
+         * @brief Sets how deeply function calls can be nested before a call fails with a stack overflow error. Applies to the whole state.
+         * 
+         * @param max_depth The maximum number of nested calls. Defaults to 100000.
+         */
+        void set_max_call_depth(uint32_t max_depth);
+
         uint32_t get_sourdo_func_param_count(int index);
 
         /**
@@ -215,6 +291,86 @@ namespace sourdo
          */
         void error(const std::string& message);
 
+        /**
+         * @brief Runs a full garbage collection right away.
+         */
+        void collect_garbage();
+
+        /**
+         * @brief Controls how often full garbage collections run. They run once the heap reaches 'growth_factor' times the size 
+         * that survived the last full collection, but never before it reaches 'minimum_threshold' bytes.
+         * 
+         * @param growth_factor Defaults to 2. Values below 1 are treated as 1.
+         * @param minimum_threshold Defaults to 1 MiB.
+         */
+        void set_gc_params(float growth_factor, size_t minimum_threshold);
+
+        /**
+         * @brief Controls how often minor collections run. New objects are collected on their own each time 'size' bytes of them
+         * have been allocated, and the ones that survive are kept until the next full collection.
+         * 
+         * @param size Defaults to 256 KiB.
+         */
+        void set_nursery_size(size_t size);
+
+        /**
+         * @brief Controls how much work a full collection does per pause. Full collections are spread over the allocations that 
+         * happen while they run: every 'step_size' bytes allocated, they mark or sweep at most 'work_per_step' objects or references.
+         * 
+         * @param step_size Defaults to 16 KiB. With 0, every full collection runs in one pause.
+         * @param work_per_step Defaults to 3000.
+         */
+        void set_gc_step(size_t step_size, size_t work_per_step);
+
+        /**
+         * @brief Moves the marking of full collections to a background thread, so the program only pauses to scan the roots
+         * when a collection starts and ends, and to collect the young generation. The first store into an old object
+         * during a collection grays what that object holds, so writing to one huge table can still cost a pause.
+         * Sweeping keeps following set_gc_step().
+         * 
+         * @param enabled Defaults to false.
+         */
+        void set_concurrent_marking(bool enabled);
+
+        /**
+         * @brief Runs the finalizers of collected CppObjects, oldest first, and frees the objects. Collections never run
+         * host code themselves, so hosts that use finalizers should call this regularly, at a point where that code can run.
+         * 
+         * @param max_count The most finalizers to run in this call.
+         * 
+         * @returns How many finalizers are still queued.
+         */
+        size_t run_finalizers(size_t max_count = SIZE_MAX);
+
+        /**
+         * @brief Returns how many bytes the heap of this state uses: its objects, the text of its strings and the entries of its tables.
+         */
+        size_t get_memory_usage();
+
+        /**
+         * @brief Limits the memory the heap of this state may use. Both limits default to SIZE_MAX, which disables them.
+         * 
+         * @param soft_limit Once the heap reaches it, a full collection runs in one pause at the next safe point.
+         * @param hard_limit An allocation that would take the heap past it fails. Code run by do_string() or do_file()
+         * stops with a runtime error, and the functions of the Data API throw SourDoError. Keep it well above the soft
+         * limit, so that garbage is collected before it is reached.
+         */
+        void set_memory_limits(size_t soft_limit, size_t hard_limit);
+
+        /**
+         * @brief Returns the lengths of the pauses of every collection so far, minor collections and collection steps included.
+         */
+        GCPauseHistogram get_gc_pause_histogram();
+
+        void reset_gc_pause_histogram();
+
+        /**
+         * @brief Returns the inline cache hits and misses of the property accesses on objects of this state so far.
+         */
+        InlineCacheStats get_inline_cache_stats();
+
+        void reset_inline_cache_stats();
+
         /**
          * @brief Not for use outside of library code.
          */
@@ -8,6 +8,8 @@ namespace sourdo
     bool to_string(Data& data);
     bool format(Data& data);
     bool error(Data& data);
+    // set_weak(table, weak_keys, weak_values)
+    bool set_weak(Data& data);
 
     void load_lib_basic(Data& data);
 } // namespace sourdo
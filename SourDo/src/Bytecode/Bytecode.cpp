@@ -11,6 +11,9 @@ namespace sourdo
     {
         switch(op)
         {
+            case OP_EXTENDED_ARG:
+                os << "extended_arg";
+                break;
             case OP_PUSH_NUMBER: 
                 os << "push_num"; 
                 break;
@@ -80,6 +83,18 @@ namespace sourdo
             case OP_SYM_SET:
                 os << "sym_set"; 
                 break;
+            case OP_LOCAL_GET:
+                os << "local_get";
+                break;
+            case OP_LOCAL_SET:
+                os << "local_set";
+                break;
+            case OP_GLOBAL_GET:
+                os << "global_get";
+                break;
+            case OP_GLOBAL_SET:
+                os << "global_set";
+                break;
             case OP_AlLOC_TABLE:
                 os << "alloc_table"; 
                 break;
@@ -164,10 +179,76 @@ namespace sourdo
             case OP_RET: 
                 os << "ret"; 
                 break;
+            case OP_HALT:
+                os << "halt";
+                break;
         }
         return os;
     }
 
+    void Bytecode::emit(Opcode op, uint64_t operand)
+    {
+        int shift = 0;
+        while((operand >> shift) > MAX_OPERAND)
+        {
+            shift += OPERAND_BITS;
+        }
+        for(; shift > 0; shift -= OPERAND_BITS)
+        {
+            instructions.emplace_back(OP_EXTENDED_ARG, (operand >> shift) & MAX_OPERAND);
+        }
+        instructions.emplace_back(op, operand & MAX_OPERAND);
+    }
+
+    bool Bytecode::patch_operand(uint64_t position, uint64_t operand)
+    {
+        if(operand > MAX_OPERAND)
+        {
+            return false;
+        }
+        instructions[position].set_operand(operand);
+        return true;
+    }
+
+    bool has_operand(Opcode op)
+    {
+        switch(op)
+        {
+            case OP_EXTENDED_ARG:
+            case OP_PUSH_NUMBER:
+            case OP_PUSH_STRING:
+            case OP_PUSH_BOOL:
+            case OP_PUSH_FUNC:
+            case OP_CREATE_SUBTYPE:
+            case OP_CREATE_TYPE:
+            case OP_SET_SETTER:
+            case OP_SET_GETTER:
+            case OP_SET_METHOD:
+            case OP_ADD_PROPERTY:
+            case OP_ADD_CONST_PROPERTY:
+            case OP_STACK_GET:
+            case OP_STACK_GET_TOP:
+            case OP_SYM_CREATE:
+            case OP_SYM_CONST:
+            case OP_SYM_GET:
+            case OP_SYM_SET:
+            case OP_LOCAL_GET:
+            case OP_LOCAL_SET:
+            case OP_GLOBAL_GET:
+            case OP_GLOBAL_SET:
+            case OP_VAL_SET:
+            case OP_VAL_GET:
+            case OP_JMP:
+            case OP_NJMP:
+            case OP_TYPE_CHECK:
+            case OP_REMOVE_TOP:
+            case OP_CALL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
     static void print_bytecode(std::ostream& os, std::function<void(std::ostream&)> print_name, const Bytecode& bytecode, uint32_t indent)
     {
         print_name(os);
@@ -176,12 +257,17 @@ namespace sourdo
         os << "INSTRUCTIONS for ";
         print_name(os);
         os << ":\n";
+        uint64_t extended_operand = 0;
         for(int i = 0; i < bytecode.instructions.size(); i++)
         {
             for(int j = 0; j < indent + 1; j++) os << "\t";
 
-            os << "[" << i << "]" << "\t" << bytecode.instructions[i].op;
-            if(bytecode.instructions[i].operand)
+            Opcode op = bytecode.instructions[i].op();
+            uint64_t operand = extended_operand | bytecode.instructions[i].operand();
+            extended_operand = op == OP_EXTENDED_ARG? operand << OPERAND_BITS : 0;
+
+            os << "[" << i << "]" << "\t" << op;
+            if(has_operand(op))
             {
                 static const std::array<Opcode, 17> multi_tab = 
                 {
@@ -203,8 +289,7 @@ namespace sourdo
                     OP_CALL,
                     OP_RET,
                 };
-                if(std::find(multi_tab.begin(), multi_tab.end(), 
-                        bytecode.instructions[i].op) != multi_tab.end())
+                if(std::find(multi_tab.begin(), multi_tab.end(), op) != multi_tab.end())
                 {
                     os << ",\t\t";
                 }
@@ -212,7 +297,7 @@ namespace sourdo
                 {
                     os << ",\t";
                 }
-                os << bytecode.instructions[i].operand.value();
+                os << operand;
             }
             os << "\n";
         }
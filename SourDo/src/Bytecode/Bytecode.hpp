@@ -11,6 +11,8 @@ namespace sourdo
 {
     enum Opcode : uint8_t
     {
+        OP_EXTENDED_ARG,
+
         OP_PUSH_NUMBER,
         OP_PUSH_STRING,
         OP_PUSH_BOOL,
@@ -37,6 +39,10 @@ namespace sourdo
         OP_SYM_CONST,
         OP_SYM_GET,
         OP_SYM_SET,
+        OP_LOCAL_GET,
+        OP_LOCAL_SET,
+        OP_GLOBAL_GET,
+        OP_GLOBAL_SET,
 
         OP_AlLOC_TABLE,
         OP_VAL_SET,
@@ -72,18 +78,42 @@ namespace sourdo
 
         OP_CALL,
         OP_RET,
+        // Ends the main chunk. Keep this last.
+        OP_HALT,
     };
 
+    constexpr uint32_t OPERAND_BITS = 24;
+    constexpr uint32_t MAX_OPERAND = (1 << OPERAND_BITS) - 1;
+
+    /**
+     * Instructions are packed into 32 bits: the low 8 bits hold the opcode and the high 24 bits hold the operand.
+     * Operands that do not fit are split across OP_EXTENDED_ARG prefixes, most significant bits first.
+     */
     struct Instruction
     {
-        Instruction(Opcode op, std::optional<uint64_t> operand = {})
-            : op(op), operand(operand)
+        Instruction(Opcode op, uint32_t operand = 0)
+            : word(op | (operand << 8))
+        {
+        }
+
+        Opcode op() const
+        {
+            return (Opcode)(word & 0xFF);
+        }
+
+        uint32_t operand() const
         {
+            return word >> 8;
         }
 
-        Opcode op;
-        std::optional<uint64_t> operand;
+        void set_operand(uint32_t operand)
+        {
+            word = (word & 0xFF) | (operand << 8);
+        }
+
+        uint32_t word;
     };
+    static_assert(sizeof(Instruction) == 4);
     
     struct Bytecode
     {
@@ -91,8 +121,82 @@ namespace sourdo
         std::string scope_name;
         std::vector<Instruction> instructions;
         std::vector<Value> constants;
+        // Number of local slots the chunk needs in its frame, parameters included.
+        uint64_t slot_count = 0;
+
+        // Remembers where a global lives in the root scope for one OP_GLOBAL_GET/OP_GLOBAL_SET.
+        struct GlobalCache
+        {
+            // Constant index of the global's name.
+            uint64_t name = 0;
+            uint64_t slot = 0;
+            // The root's globals_version when the slot was cached. Zero means the cache is empty.
+            uint64_t version = 0;
+        };
+        // Indexed by the operand of OP_GLOBAL_GET/OP_GLOBAL_SET. Filled in by the VM as the instructions run.
+        mutable std::vector<GlobalCache> global_caches;
+
+        // Remembers what one OP_VAL_GET/OP_VAL_SET found on objects of the last few shapes it saw.
+        struct PropertyCache
+        {
+            enum class Kind : uint8_t
+            {
+                SLOT,
+                GETTER,
+                SETTER,
+                METHOD,
+            };
+
+            struct Entry
+            {
+                // Zero means the entry is empty.
+                uint64_t shape_id = 0;
+                // The interned name that was looked up.
+                const String* name = nullptr;
+                Kind kind = Kind::SLOT;
+                uint32_t slot = 0;
+                // Private members only hit for code running with this class context. Zero for public members.
+                uint32_t class_context = 0;
+                // The getter, setter or method in the class that defines it.
+                Value* member = nullptr;
+            };
+            static constexpr size_t ENTRY_COUNT = 4;
+
+            const Entry* find(uint64_t shape_id, const String* name) const
+            {
+                for(const Entry& entry : entries)
+                {
+                    if(entry.shape_id == shape_id && entry.name == name)
+                    {
+                        return &entry;
+                    }
+                }
+                return nullptr;
+            }
+
+            // Once every entry is in use, the oldest one is replaced.
+            const Entry& insert(const Entry& entry)
+            {
+                Entry& replaced = entries[next];
+                next = (next + 1) % ENTRY_COUNT;
+                replaced = entry;
+                return replaced;
+            }
+
+            Entry entries[ENTRY_COUNT];
+            uint8_t next = 0;
+        };
+        // Indexed by the operand of OP_VAL_GET/OP_VAL_SET. Filled in by the VM as the instructions run.
+        mutable std::vector<PropertyCache> property_caches;
+
+        // Appends an instruction, preceded by OP_EXTENDED_ARG prefixes if the operand needs more than 24 bits.
+        void emit(Opcode op, uint64_t operand = 0);
+        // Rewrites the operand of a previously emitted instruction. Returns false if it does not fit in 24 bits.
+        bool patch_operand(uint64_t position, uint64_t operand);
     };
 
+    bool has_operand(Opcode op);
+
     std::ostream& operator<<(std::ostream& os, Opcode op);
     std::ostream& operator<<(std::ostream& os, const Bytecode& bytecode);
 } // namespace sourdo
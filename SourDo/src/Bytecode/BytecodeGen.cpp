@@ -1,6 +1,7 @@
 #include "BytecodeGen.hpp"
 
 #include "../SourDoData.hpp"
+#include "../GarbageCollector.hpp"
 #include "../Datatypes/Function.hpp"
 
 #include <exception>
@@ -9,8 +10,16 @@ namespace sourdo
 {
     BytecodeGenerator::Result BytecodeGenerator::generate_bytecode(std::shared_ptr<Node> ast)
     {
+        std::unordered_set<std::string> used;
+        std::unordered_set<std::string> declared;
+        collect_free_names(ast, used, declared, true);
+
         Bytecode bytecode;
+        begin_function({}, bytecode);
+        functions.back().is_main = true;
         visit_node(ast, bytecode);
+        bytecode.emit(OP_HALT);
+        end_function(bytecode);
         return {std::move(bytecode), error};
     }
 
@@ -26,20 +35,319 @@ namespace sourdo
         return const_position;
     }
 
+    uint64_t BytecodeGenerator::push_string_constant(const std::string& text, Bytecode& bytecode)
+    {
+        // Constant strings are used as identifiers and property names, so they are always interned.
+        return push_constant(heap.intern_string(text), bytecode);
+    }
+
+    void BytecodeGenerator::patch_jump(uint64_t position, uint64_t target, Bytecode& bytecode)
+    {
+        if(!bytecode.patch_operand(position, target))
+        {
+            std::stringstream ss;
+            ss << bytecode.file_name << "(Compile Error): Jump target " << target << " is out of range";
+            error = ss.str();
+        }
+    }
+
     void BytecodeGenerator::fix_control_flows(uint64_t continue_spot, uint64_t break_spot, Bytecode& bytecode)
     {
         for(auto& brk : breaks)
         {
-            bytecode.instructions[brk].operand = break_spot;
+            patch_jump(brk, break_spot, bytecode);
         }
         breaks.clear();
         for(auto& cont : continues)
         {
-            bytecode.instructions[cont].operand = continue_spot;
+            patch_jump(cont, continue_spot, bytecode);
         }
         continues.clear();
     }
     
+    void BytecodeGenerator::collect_free_names(std::shared_ptr<Node> node, std::unordered_set<std::string>& used, std::unordered_set<std::string>& declared, bool top_level)
+    {
+        if(node == nullptr)
+        {
+            return;
+        }
+
+        switch(node->type)
+        {
+            case Node::Type::STATEMENT_LIST_NODE:
+                for(auto& stmt : std::static_pointer_cast<StatementListNode>(node)->statements)
+                {
+                    collect_free_names(stmt, used, declared, top_level);
+                }
+                break;
+            case Node::Type::CLASS_NODE:
+            {
+                auto class_node = std::static_pointer_cast<ClassNode>(node);
+                declared.insert(class_node->class_name.value);
+                if(!top_level)
+                {
+                    local_names.insert(class_node->class_name.value);
+                }
+                if(class_node->super_name)
+                {
+                    used.insert(class_node->super_name.value().value);
+                }
+
+                // Property initializers run inside the class initializer, which is a function of its own.
+                std::unordered_set<std::string> initializer_used;
+                std::unordered_set<std::string> initializer_declared;
+                for(auto&[name, decl] : class_node->properties)
+                {
+                    collect_free_names(decl.initial_value, initializer_used, initializer_declared);
+                }
+                for(auto& name : initializer_used)
+                {
+                    free_names.insert(name);
+                }
+
+                for(auto&[name, decl] : class_node->methods)
+                {
+                    collect_free_names(decl.initial_value, used, declared);
+                }
+                for(auto&[name, setter] : class_node->setters)
+                {
+                    collect_function_free_names({setter.self_name.value, setter.new_value_name.value}, setter.statements);
+                }
+                for(auto&[name, getter] : class_node->getters)
+                {
+                    collect_function_free_names({getter.self_name.value}, getter.statements);
+                }
+                break;
+            }
+            case Node::Type::IF_NODE:
+            {
+                auto if_node = std::static_pointer_cast<IfNode>(node);
+                for(auto& if_case : if_node->cases)
+                {
+                    collect_free_names(if_case.condition, used, declared);
+                    collect_free_names(if_case.statements, used, declared);
+                }
+                collect_free_names(if_node->else_case, used, declared);
+                break;
+            }
+            case Node::Type::FOR_NODE:
+            {
+                auto for_node = std::static_pointer_cast<ForNode>(node);
+                collect_free_names(for_node->initializer, used, declared);
+                collect_free_names(for_node->condition, used, declared);
+                collect_free_names(for_node->increment, used, declared);
+                collect_free_names(for_node->statements, used, declared);
+                break;
+            }
+            case Node::Type::WHILE_NODE:
+            {
+                auto while_node = std::static_pointer_cast<WhileNode>(node);
+                collect_free_names(while_node->condition, used, declared);
+                collect_free_names(while_node->statements, used, declared);
+                break;
+            }
+            case Node::Type::LOOP_NODE:
+                collect_free_names(std::static_pointer_cast<LoopNode>(node)->statements, used, declared);
+                break;
+            case Node::Type::VAR_DECLARATION_NODE:
+            {
+                auto decl_node = std::static_pointer_cast<VarDeclarationNode>(node);
+                declared.insert(decl_node->name_tok.value);
+                if(!top_level)
+                {
+                    local_names.insert(decl_node->name_tok.value);
+                }
+                collect_free_names(decl_node->initializer, used, declared);
+                break;
+            }
+            case Node::Type::ASSIGNMENT_NODE:
+            {
+                auto assign_node = std::static_pointer_cast<AssignmentNode>(node);
+                collect_free_names(assign_node->assignee, used, declared);
+                collect_free_names(assign_node->new_value, used, declared);
+                break;
+            }
+            case Node::Type::FUNC_NODE:
+            {
+                auto func_node = std::static_pointer_cast<FuncNode>(node);
+                collect_function_free_names(func_node->parameters, func_node->statements);
+                break;
+            }
+            case Node::Type::RETURN_NODE:
+                collect_free_names(std::static_pointer_cast<ReturnNode>(node)->return_value, used, declared);
+                break;
+            case Node::Type::BINARY_OP_NODE:
+            {
+                auto binary_node = std::static_pointer_cast<BinaryOpNode>(node);
+                collect_free_names(binary_node->left_operand, used, declared);
+                collect_free_names(binary_node->right_operand, used, declared);
+                break;
+            }
+            case Node::Type::UNARY_OP_NODE:
+                collect_free_names(std::static_pointer_cast<UnaryOpNode>(node)->operand, used, declared);
+                break;
+            case Node::Type::IS_NODE:
+                collect_free_names(std::static_pointer_cast<IsNode>(node)->left_operand, used, declared);
+                break;
+            case Node::Type::CALL_NODE:
+            {
+                auto call_node = std::static_pointer_cast<CallNode>(node);
+                collect_free_names(call_node->callee, used, declared);
+                for(auto& arg : call_node->arguments)
+                {
+                    collect_free_names(arg, used, declared);
+                }
+                break;
+            }
+            case Node::Type::INDEX_NODE:
+            {
+                auto index_node = std::static_pointer_cast<IndexNode>(node);
+                collect_free_names(index_node->base, used, declared);
+                collect_free_names(index_node->attribute, used, declared);
+                break;
+            }
+            case Node::Type::INDEX_CALL_NODE:
+            {
+                auto index_call_node = std::static_pointer_cast<IndexCallNode>(node);
+                collect_free_names(index_call_node->base, used, declared);
+                collect_free_names(index_call_node->callee, used, declared);
+                for(auto& arg : index_call_node->arguments)
+                {
+                    collect_free_names(arg, used, declared);
+                }
+                break;
+            }
+            case Node::Type::IDENTIFIER_NODE:
+                used.insert(std::static_pointer_cast<IdentifierNode>(node)->name_tok.value);
+                break;
+            case Node::Type::TABLE_NODE:
+                for(auto&[k, v] : std::static_pointer_cast<TableNode>(node)->keys)
+                {
+                    collect_free_names(k, used, declared);
+                    collect_free_names(v, used, declared);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void BytecodeGenerator::collect_function_free_names(const std::vector<std::string>& parameters, std::shared_ptr<Node> body)
+    {
+        std::unordered_set<std::string> used;
+        std::unordered_set<std::string> declared(parameters.begin(), parameters.end());
+        local_names.insert(parameters.begin(), parameters.end());
+        collect_free_names(body, used, declared);
+        for(auto& name : used)
+        {
+            if(declared.find(name) == declared.end())
+            {
+                free_names.insert(name);
+            }
+        }
+    }
+
+    void BytecodeGenerator::begin_function(const std::vector<std::string>& parameters, Bytecode& bytecode)
+    {
+        functions.emplace_back();
+        FunctionScope& function = functions.back();
+        function.blocks.emplace_back();
+        function.block_starts.emplace_back(0);
+
+        // Arguments are passed in the first slots of the frame.
+        for(uint64_t i = 0; i < parameters.size(); i++)
+        {
+            if(free_names.find(parameters[i]) != free_names.end())
+            {
+                bytecode.emit(OP_STACK_GET, i + 1);
+                bytecode.emit(OP_SYM_CREATE, push_string_constant(parameters[i], bytecode));
+                function.blocks.back()[parameters[i]] = {};
+            }
+            else
+            {
+                function.blocks.back()[parameters[i]] = Local{i, false};
+            }
+        }
+        function.next_slot = parameters.size();
+        function.slot_count = parameters.size();
+    }
+
+    void BytecodeGenerator::end_function(Bytecode& bytecode)
+    {
+        bytecode.slot_count = functions.back().slot_count;
+        functions.pop_back();
+    }
+
+    void BytecodeGenerator::begin_block()
+    {
+        FunctionScope& function = functions.back();
+        function.blocks.emplace_back();
+        function.block_starts.emplace_back(function.next_slot);
+    }
+
+    void BytecodeGenerator::end_block()
+    {
+        // Slots of the block's locals are reused by the blocks that follow it.
+        FunctionScope& function = functions.back();
+        function.next_slot = function.block_starts.back();
+        function.blocks.pop_back();
+        function.block_starts.pop_back();
+    }
+
+    std::optional<BytecodeGenerator::Local> BytecodeGenerator::declare_local(const std::string& name, bool readonly)
+    {
+        FunctionScope& function = functions.back();
+        if((function.is_main && function.blocks.size() == 1) || free_names.find(name) != free_names.end())
+        {
+            function.blocks.back()[name] = {};
+            return {};
+        }
+
+        Local local = {function.next_slot++, readonly};
+        function.slot_count = std::max(function.slot_count, function.next_slot);
+        function.blocks.back()[name] = local;
+        return local;
+    }
+
+    std::optional<BytecodeGenerator::Local> BytecodeGenerator::resolve_local(const std::string& name)
+    {
+        FunctionScope& function = functions.back();
+        for(auto block = function.blocks.rbegin(); block != function.blocks.rend(); block++)
+        {
+            auto it = block->find(name);
+            if(it != block->end())
+            {
+                return it->second;
+            }
+        }
+        return {};
+    }
+
+    bool BytecodeGenerator::is_global_name(const std::string& name)
+    {
+        FunctionScope& function = functions.back();
+        for(uint64_t i = function.blocks.size(); i-- > 0;)
+        {
+            if(function.blocks[i].find(name) != function.blocks[i].end())
+            {
+                return function.is_main && i == 0;
+            }
+        }
+        return local_names.find(name) == local_names.end() || free_names.find(name) == free_names.end();
+    }
+
+    uint64_t BytecodeGenerator::push_global_cache(const std::string& name, Bytecode& bytecode)
+    {
+        bytecode.global_caches.push_back({push_string_constant(name, bytecode)});
+        return bytecode.global_caches.size() - 1;
+    }
+
+    uint64_t BytecodeGenerator::push_property_cache(Bytecode& bytecode)
+    {
+        bytecode.property_caches.emplace_back();
+        return bytecode.property_caches.size() - 1;
+    }
+
     void BytecodeGenerator::visit_node(std::shared_ptr<Node> node, Bytecode& bytecode)
     {
         switch(node->type)
@@ -146,43 +454,47 @@ namespace sourdo
             }
             if(std::find(expression_types.begin(), expression_types.end(), stmt->type) != expression_types.end())
             {
-                bytecode.instructions.emplace_back(OP_POP);
+                bytecode.emit(OP_POP);
             }
         }
     }
 
     void BytecodeGenerator::visit_class_node(std::shared_ptr<ClassNode> node, Bytecode& bytecode)
     {
-        uint64_t class_name = push_constant(node->class_name.value, bytecode);
+        uint64_t class_name = push_string_constant(node->class_name.value, bytecode);
+        uint32_t class_context = heap.type_id(node->class_name.value);
         if(node->super_name)
         {
-            bytecode.instructions.emplace_back(OP_SYM_GET, push_constant(node->super_name.value().value, bytecode));
-            bytecode.instructions.emplace_back(OP_CREATE_SUBTYPE, class_name);
+            bytecode.emit(OP_SYM_GET, push_string_constant(node->super_name.value().value, bytecode));
+            bytecode.emit(OP_CREATE_SUBTYPE, class_name);
         }
         else
         {
-            bytecode.instructions.emplace_back(OP_CREATE_TYPE, class_name);
+            bytecode.emit(OP_CREATE_TYPE, class_name);
         }
-        bytecode.instructions.emplace_back(OP_STACK_GET_TOP, 1);
-        bytecode.instructions.emplace_back(OP_SYM_CONST, class_name);
+        bytecode.emit(OP_STACK_GET_TOP, 1);
+        bytecode.emit(OP_SYM_CONST, class_name);
+        // Methods find their class by name, so classes always live in the symbol table.
+        functions.back().blocks.back()[node->class_name.value] = {};
 
         Bytecode class_initializer;
-        class_initializer.instructions.emplace_back(OP_STACK_GET, 1);
+        begin_function({}, class_initializer);
+        class_initializer.emit(OP_STACK_GET, 1);
         if(node->super_name)
         {
-            class_initializer.instructions.emplace_back(OP_SYM_GET, push_constant(node->super_name.value().value, class_initializer));
-            class_initializer.instructions.emplace_back(OP_GET_INITIALIZER);
-            class_initializer.instructions.emplace_back(OP_REMOVE_TOP, 2);
+            class_initializer.emit(OP_SYM_GET, push_string_constant(node->super_name.value().value, class_initializer));
+            class_initializer.emit(OP_GET_INITIALIZER);
+            class_initializer.emit(OP_REMOVE_TOP, 2);
 
-            class_initializer.instructions.emplace_back(OP_STACK_GET_TOP, 2);
-            class_initializer.instructions.emplace_back(OP_CALL, 1);
-            class_initializer.instructions.emplace_back(OP_POP);
+            class_initializer.emit(OP_STACK_GET_TOP, 2);
+            class_initializer.emit(OP_CALL, 1);
+            class_initializer.emit(OP_POP);
         }
 
+        // Properties get the class context of the initializer that adds them.
         for(auto&[name, decl] : node->properties)
         {
-            class_initializer.instructions.emplace_back(OP_PUSH_STRING, push_constant(node->class_name.value, class_initializer));
-            class_initializer.instructions.emplace_back(OP_PUSH_STRING, push_constant(name, class_initializer));
+            class_initializer.emit(OP_PUSH_STRING, push_string_constant(name, class_initializer));
             
             if(decl.initial_value)
             {
@@ -190,17 +502,18 @@ namespace sourdo
             }
             else
             {
-                class_initializer.instructions.emplace_back(OP_PUSH_NULL);
+                class_initializer.emit(OP_PUSH_NULL);
             }
 
-            class_initializer.instructions.emplace_back(decl.readonly? OP_ADD_CONST_PROPERTY : OP_ADD_PROPERTY, decl.is_private);
+            class_initializer.emit(decl.readonly? OP_ADD_CONST_PROPERTY : OP_ADD_PROPERTY, decl.is_private);
         }
-        class_initializer.instructions.emplace_back(OP_PUSH_NULL);
-        class_initializer.instructions.emplace_back(OP_RET);
+        class_initializer.emit(OP_PUSH_NULL);
+        class_initializer.emit(OP_RET);
+        end_function(class_initializer);
 
-        SourDoFunction* value = new SourDoFunction(1, node->class_name.value, class_initializer);
-        bytecode.instructions.emplace_back(OP_PUSH_FUNC, push_constant(value, bytecode));
-        bytecode.instructions.emplace_back(OP_SET_INITIALIZER);
+        SourDoFunction* value = new(heap) SourDoFunction(1, class_context, class_initializer);
+        bytecode.emit(OP_PUSH_FUNC, push_constant(value, bytecode));
+        bytecode.emit(OP_SET_INITIALIZER);
 
         for(auto&[name, decl] : node->methods)
         {
@@ -209,57 +522,49 @@ namespace sourdo
                 auto func_node = std::static_pointer_cast<FuncNode>(decl.initial_value);
 
                 Bytecode class_new;
-                uint64_t type = push_constant(node->class_name.value, class_new);
-                class_new.instructions.emplace_back(OP_SYM_GET, type);
-                class_new.instructions.emplace_back(OP_ALLOC_OBJECT);
-
-                class_new.instructions.emplace_back(OP_SYM_GET, type);
-                class_new.instructions.emplace_back(OP_GET_INITIALIZER);
-                class_new.instructions.emplace_back(OP_REMOVE_TOP, 2);
-
-                class_new.instructions.emplace_back(OP_STACK_GET_TOP, 2);
-                class_new.instructions.emplace_back(OP_CALL, 1);
-                class_new.instructions.emplace_back(OP_POP);
-
-                class_new.instructions.emplace_back(OP_STACK_GET_TOP, 1);
-                class_new.instructions.emplace_back(OP_PUSH_STRING, push_constant("new", class_new));
-                class_new.instructions.emplace_back(OP_VAL_GET);
-                class_new.instructions.emplace_back(OP_STACK_GET_TOP, 2);
+                uint64_t type = push_string_constant(node->class_name.value, class_new);
+                class_new.emit(OP_SYM_GET, type);
+                class_new.emit(OP_ALLOC_OBJECT);
+
+                class_new.emit(OP_SYM_GET, type);
+                class_new.emit(OP_GET_INITIALIZER);
+                class_new.emit(OP_REMOVE_TOP, 2);
+
+                class_new.emit(OP_STACK_GET_TOP, 2);
+                class_new.emit(OP_CALL, 1);
+                class_new.emit(OP_POP);
+
+                class_new.emit(OP_STACK_GET_TOP, 1);
+                class_new.emit(OP_PUSH_STRING, push_string_constant("new", class_new));
+                class_new.emit(OP_VAL_GET, push_property_cache(class_new));
+                class_new.emit(OP_STACK_GET_TOP, 2);
                 for(uint32_t i = 1; i < func_node->parameters.size(); i++)
                 {
-                    class_new.instructions.emplace_back(OP_STACK_GET, i);
+                    class_new.emit(OP_STACK_GET, i);
                 }
-                class_new.instructions.emplace_back(OP_CALL, func_node->parameters.size());
-                class_new.instructions.emplace_back(OP_POP);
+                class_new.emit(OP_CALL, func_node->parameters.size());
+                class_new.emit(OP_POP);
 
-                class_new.instructions.emplace_back(OP_STACK_GET_TOP, 1);
-                class_new.instructions.emplace_back(OP_RET);
+                class_new.emit(OP_STACK_GET_TOP, 1);
+                class_new.emit(OP_RET);
 
-                bytecode.instructions.emplace_back(OP_PUSH_STRING, push_constant("new", bytecode));
-                SourDoFunction* class_method = new SourDoFunction(func_node->parameters.size() - 1, node->class_name.value, class_new);
-                bytecode.instructions.emplace_back(OP_PUSH_FUNC, push_constant(class_method, bytecode));
-                bytecode.instructions.emplace_back(OP_SET_CLASS_PROP);
+                bytecode.emit(OP_PUSH_STRING, push_string_constant("new", bytecode));
+                SourDoFunction* class_method = new(heap) SourDoFunction(func_node->parameters.size() - 1, class_context, class_new);
+                bytecode.emit(OP_PUSH_FUNC, push_constant(class_method, bytecode));
+                bytecode.emit(OP_SET_CLASS_PROP);
             }
             
-            bytecode.instructions.emplace_back(OP_PUSH_STRING, push_constant(name, bytecode));
+            bytecode.emit(OP_PUSH_STRING, push_string_constant(name, bytecode));
 
-            visit_func_node(std::static_pointer_cast<FuncNode>(decl.initial_value), bytecode, node->class_name.value);
-            bytecode.instructions.emplace_back(OP_SET_METHOD, decl.is_private);
+            visit_func_node(std::static_pointer_cast<FuncNode>(decl.initial_value), bytecode, class_context);
+            bytecode.emit(OP_SET_METHOD, decl.is_private);
         }
 
         for(auto&[name, setter] : node->setters)
         {
             Bytecode func;
 
-            uint64_t self_name = push_constant(setter.self_name.value, func);
-
-            func.instructions.emplace_back(OP_STACK_GET, 1);
-            func.instructions.emplace_back(OP_SYM_CREATE, self_name);
-
-            uint64_t new_value_name = push_constant(setter.new_value_name.value, func);
-
-            func.instructions.emplace_back(OP_STACK_GET, 2);
-            func.instructions.emplace_back(OP_SYM_CREATE, new_value_name);
+            begin_function({setter.self_name.value, setter.new_value_name.value}, func);
 
             visit_node(setter.statements, func);
             if(error) return;
@@ -267,27 +572,25 @@ namespace sourdo
             if(setter.statements->statements.size() == 0 
                     || setter.statements->statements[setter.statements->statements.size() -1]->type != Node::Type::RETURN_NODE)
             {
-                func.instructions.emplace_back(OP_PUSH_NULL);
-                func.instructions.emplace_back(OP_RET);
+                func.emit(OP_PUSH_NULL);
+                func.emit(OP_RET);
             }
+            end_function(func);
 
-            uint64_t prop_name = push_constant(name, bytecode);
-            bytecode.instructions.emplace_back(OP_PUSH_STRING, prop_name);
+            uint64_t prop_name = push_string_constant(name, bytecode);
+            bytecode.emit(OP_PUSH_STRING, prop_name);
 
-            SourDoFunction* value = new SourDoFunction(2, node->class_name.value, func);
+            SourDoFunction* value = new(heap) SourDoFunction(2, class_context, func);
             uint64_t constant = push_constant(value, bytecode);
-            bytecode.instructions.emplace_back(OP_PUSH_FUNC, constant);
-            bytecode.instructions.emplace_back(OP_SET_SETTER, setter.is_private);
+            bytecode.emit(OP_PUSH_FUNC, constant);
+            bytecode.emit(OP_SET_SETTER, setter.is_private);
         }
 
         for(auto&[name, getter] : node->getters)
         {
             Bytecode func;
 
-            uint64_t self_name = push_constant(getter.self_name.value, func);
-
-            func.instructions.emplace_back(OP_STACK_GET, 1);
-            func.instructions.emplace_back(OP_SYM_CREATE, self_name);
+            begin_function({getter.self_name.value}, func);
 
             visit_node(getter.statements, func);
             if(error) return;
@@ -295,20 +598,21 @@ namespace sourdo
             if(getter.statements->statements.size() == 0 
                     || getter.statements->statements[getter.statements->statements.size() -1]->type != Node::Type::RETURN_NODE)
             {
-                func.instructions.emplace_back(OP_PUSH_NULL);
-                func.instructions.emplace_back(OP_RET);
+                func.emit(OP_PUSH_NULL);
+                func.emit(OP_RET);
             }
+            end_function(func);
 
-            uint64_t prop_name = push_constant(name, bytecode);
-            bytecode.instructions.emplace_back(OP_PUSH_STRING, prop_name);
+            uint64_t prop_name = push_string_constant(name, bytecode);
+            bytecode.emit(OP_PUSH_STRING, prop_name);
 
-            SourDoFunction* value = new SourDoFunction(1, node->class_name.value, func);
+            SourDoFunction* value = new(heap) SourDoFunction(1, class_context, func);
             uint64_t constant = push_constant(value, bytecode);
-            bytecode.instructions.emplace_back(OP_PUSH_FUNC, constant);
-            bytecode.instructions.emplace_back(OP_SET_GETTER, getter.is_private);
+            bytecode.emit(OP_PUSH_FUNC, constant);
+            bytecode.emit(OP_SET_GETTER, getter.is_private);
         }
-        bytecode.instructions.emplace_back(OP_FINISH_TYPE);
-        bytecode.instructions.emplace_back(OP_POP);
+        bytecode.emit(OP_FINISH_TYPE);
+        bytecode.emit(OP_POP);
     }
 
     void BytecodeGenerator::visit_if_node(std::shared_ptr<IfNode> node, Bytecode& bytecode)
@@ -321,47 +625,53 @@ namespace sourdo
             if(error) return;
             
             uint64_t jump_position = bytecode.instructions.size();
-            bytecode.instructions.emplace_back(OP_NJMP);
-            bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+            bytecode.emit(OP_NJMP);
+            bytecode.emit(OP_PUSH_SCOPE);
+            begin_block();
             visit_node(if_case.statements, bytecode);
             if(error) return;
 
-            bytecode.instructions.emplace_back(OP_POP_SCOPE);
+            end_block();
+            bytecode.emit(OP_POP_SCOPE);
 
             jumps.emplace_back(bytecode.instructions.size());
-            bytecode.instructions.emplace_back(OP_JMP);
-            bytecode.instructions[jump_position].operand = bytecode.instructions.size();
+            bytecode.emit(OP_JMP);
+            patch_jump(jump_position, bytecode.instructions.size(), bytecode);
         }
 
         if(node->else_case)
         {
-            bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+            bytecode.emit(OP_PUSH_SCOPE);
+            begin_block();
             visit_node(node->else_case, bytecode);
             if(error) return;
 
-            bytecode.instructions.emplace_back(OP_POP_SCOPE);
+            end_block();
+            bytecode.emit(OP_POP_SCOPE);
         }
 
         for(auto& jmp : jumps) 
         {
-            bytecode.instructions[jmp].operand = bytecode.instructions.size();
+            patch_jump(jmp, bytecode.instructions.size(), bytecode);
         }
     }
 
     void BytecodeGenerator::visit_for_node(std::shared_ptr<ForNode> node, Bytecode& bytecode)
     {
-        bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+        bytecode.emit(OP_PUSH_SCOPE);
+        begin_block();
 
         visit_node(node->initializer, bytecode);
         if(error) return;
         
         uint64_t start_position = bytecode.instructions.size();
-        bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+        bytecode.emit(OP_PUSH_SCOPE);
+        begin_block();
         visit_node(node->condition, bytecode);
         if(error) return;
 
         uint64_t jump_position = bytecode.instructions.size();
-        bytecode.instructions.emplace_back(OP_NJMP);
+        bytecode.emit(OP_NJMP);
 
         bool saved_in_loop = in_loop;
         in_loop = true;
@@ -372,27 +682,32 @@ namespace sourdo
 
         uint64_t continue_spot = bytecode.instructions.size();
 
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        end_block();
+        bytecode.emit(OP_POP_SCOPE);
 
         visit_node(node->increment, bytecode);
         if(error) return;
 
-        bytecode.instructions.emplace_back(OP_JMP, start_position);
+        bytecode.emit(OP_JMP, start_position);
 
-        bytecode.instructions[jump_position].operand = bytecode.instructions.size();
+        patch_jump(jump_position, bytecode.instructions.size(), bytecode);
         fix_control_flows(continue_spot, bytecode.instructions.size(), bytecode);
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        // The first pop leaves the iteration scope, the second one the scope of the initializer.
+        bytecode.emit(OP_POP_SCOPE);
+        end_block();
+        bytecode.emit(OP_POP_SCOPE);
     }
     
     void BytecodeGenerator::visit_while_node(std::shared_ptr<WhileNode> node, Bytecode& bytecode)
     {
         uint64_t start_position = bytecode.instructions.size();
-        bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+        bytecode.emit(OP_PUSH_SCOPE);
+        begin_block();
         visit_node(node->condition, bytecode);
         if(error) return;
 
         uint64_t jump_position = bytecode.instructions.size();
-        bytecode.instructions.emplace_back(OP_NJMP);
+        bytecode.emit(OP_NJMP);
 
         bool saved_in_loop = in_loop;
         in_loop = true;
@@ -403,20 +718,22 @@ namespace sourdo
 
         uint64_t continue_spot = bytecode.instructions.size();
 
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        end_block();
+        bytecode.emit(OP_POP_SCOPE);
         
-        bytecode.instructions.emplace_back(OP_JMP, start_position);
+        bytecode.emit(OP_JMP, start_position);
 
-        bytecode.instructions[jump_position].operand = bytecode.instructions.size();
+        patch_jump(jump_position, bytecode.instructions.size(), bytecode);
         fix_control_flows(continue_spot, bytecode.instructions.size(), bytecode);
 
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        bytecode.emit(OP_POP_SCOPE);
     }
 
     void BytecodeGenerator::visit_loop_node(std::shared_ptr<LoopNode> node, Bytecode& bytecode)
     {
         uint64_t start_position = bytecode.instructions.size();
-        bytecode.instructions.emplace_back(OP_PUSH_SCOPE);
+        bytecode.emit(OP_PUSH_SCOPE);
+        begin_block();
         bool saved_in_loop = in_loop;
         in_loop = true;
         visit_node(node->statements, bytecode);
@@ -424,17 +741,17 @@ namespace sourdo
 
         in_loop = saved_in_loop;
 
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        end_block();
+        bytecode.emit(OP_POP_SCOPE);
 
-        bytecode.instructions.emplace_back(OP_JMP, start_position);
+        bytecode.emit(OP_JMP, start_position);
         fix_control_flows(start_position, bytecode.instructions.size(), bytecode);
 
-        bytecode.instructions.emplace_back(OP_POP_SCOPE);
+        bytecode.emit(OP_POP_SCOPE);
     }
 
     void BytecodeGenerator::visit_var_declaration_node(std::shared_ptr<VarDeclarationNode> node, Bytecode& bytecode)
     {
-        uint64_t var_name = push_constant(node->name_tok.value, bytecode);
         if(node->initializer)
         {
             visit_node(node->initializer, bytecode);
@@ -442,17 +759,43 @@ namespace sourdo
         }
         else
         {
-            bytecode.instructions.emplace_back(OP_PUSH_NULL);
+            bytecode.emit(OP_PUSH_NULL);
+        }
+
+        auto& block = functions.back().blocks.back();
+        auto it = block.find(node->name_tok.value);
+        if(it != block.end() && it->second)
+        {
+            std::stringstream ss;
+            ss << node->position << "'" << node->name_tok.value << "' is already defined";
+            error = ss.str();
+            return;
         }
-        bytecode.instructions.emplace_back(node->readonly ? OP_SYM_CONST : OP_SYM_CREATE, var_name);
+
+        std::optional<Local> local = declare_local(node->name_tok.value, node->readonly);
+        if(local)
+        {
+            bytecode.emit(OP_LOCAL_SET, local->slot);
+            return;
+        }
+        uint64_t var_name = push_string_constant(node->name_tok.value, bytecode);
+        bytecode.emit(node->readonly ? OP_SYM_CONST : OP_SYM_CREATE, var_name);
     }
 
     void BytecodeGenerator::visit_assignment_node(std::shared_ptr<AssignmentNode> node, Bytecode& bytecode)
     {
         if(node->assignee->type == Node::Type::IDENTIFIER_NODE)
         {
-            uint64_t sym_name = push_constant(
-                    std::static_pointer_cast<IdentifierNode>(node->assignee)->name_tok.value, bytecode);
+            const std::string& name = std::static_pointer_cast<IdentifierNode>(node->assignee)->name_tok.value;
+            std::optional<Local> local = resolve_local(name);
+            if(local && local->readonly)
+            {
+                std::stringstream ss;
+                ss << node->position << "'" << name << "' is a constant";
+                error = ss.str();
+                return;
+            }
+
             if(node->op != AssignmentNode::Operation::NONE)
             {
                 visit_node(node->assignee, bytecode);
@@ -464,21 +807,32 @@ namespace sourdo
             switch(node->op)
             {
                 case AssignmentNode::Operation::ADD:
-                    bytecode.instructions.emplace_back(OP_ADD);
+                    bytecode.emit(OP_ADD);
                     break;
                 case AssignmentNode::Operation::SUB:
-                    bytecode.instructions.emplace_back(OP_SUB);
+                    bytecode.emit(OP_SUB);
                     break;
                 case AssignmentNode::Operation::MUL:
-                    bytecode.instructions.emplace_back(OP_MUL);
+                    bytecode.emit(OP_MUL);
                     break;
                 case AssignmentNode::Operation::DIV:
-                    bytecode.instructions.emplace_back(OP_DIV);
+                    bytecode.emit(OP_DIV);
                     break;
                 default:
                     break;
             }
-            bytecode.instructions.emplace_back(OP_SYM_SET, sym_name);
+            if(local)
+            {
+                bytecode.emit(OP_LOCAL_SET, local->slot);
+            }
+            else if(is_global_name(name))
+            {
+                bytecode.emit(OP_GLOBAL_SET, push_global_cache(name, bytecode));
+            }
+            else
+            {
+                bytecode.emit(OP_SYM_SET, push_string_constant(name, bytecode));
+            }
             return;
         }
         auto index_node = std::static_pointer_cast<IndexNode>(node->assignee);
@@ -490,9 +844,9 @@ namespace sourdo
 
         if(node->op != AssignmentNode::Operation::NONE)
         {
-            bytecode.instructions.emplace_back(OP_STACK_GET_TOP, 2);
-            bytecode.instructions.emplace_back(OP_STACK_GET_TOP, 2);
-            bytecode.instructions.emplace_back(OP_VAL_GET);
+            bytecode.emit(OP_STACK_GET_TOP, 2);
+            bytecode.emit(OP_STACK_GET_TOP, 2);
+            bytecode.emit(OP_VAL_GET, push_property_cache(bytecode));
         }
         visit_node(node->new_value, bytecode);
         if(error) return;
@@ -500,33 +854,27 @@ namespace sourdo
         switch(node->op)
         {
             case AssignmentNode::Operation::ADD:
-                bytecode.instructions.emplace_back(OP_ADD);
+                bytecode.emit(OP_ADD);
                 break;
             case AssignmentNode::Operation::SUB:
-                bytecode.instructions.emplace_back(OP_SUB);
+                bytecode.emit(OP_SUB);
                 break;
             case AssignmentNode::Operation::MUL:
-                bytecode.instructions.emplace_back(OP_MUL);
+                bytecode.emit(OP_MUL);
                 break;
             case AssignmentNode::Operation::DIV:
-                bytecode.instructions.emplace_back(OP_DIV);
+                bytecode.emit(OP_DIV);
                 break;
             default:
                 break;
         }
-        bytecode.instructions.emplace_back(OP_VAL_SET);
+        bytecode.emit(OP_VAL_SET, push_property_cache(bytecode));
     }
 
-    void BytecodeGenerator::visit_func_node(std::shared_ptr<FuncNode> node, Bytecode& bytecode, const std::optional<std::string>& class_context)
+    void BytecodeGenerator::visit_func_node(std::shared_ptr<FuncNode> node, Bytecode& bytecode, uint32_t class_context)
     {
         Bytecode func;
-        for(int64_t i = 1; i <= node->parameters.size(); i++)
-        {
-            uint64_t name = push_constant(node->parameters[i - 1], func);
-
-            func.instructions.emplace_back(OP_STACK_GET, i);
-            func.instructions.emplace_back(OP_SYM_CREATE, name);
-        }
+        begin_function(node->parameters, func);
 
         visit_node(node->statements, func);
         if(error) return;
@@ -534,19 +882,20 @@ namespace sourdo
         if(node->statements->statements.size() == 0 
                 || node->statements->statements[node->statements->statements.size() -1]->type != Node::Type::RETURN_NODE)
         {
-            func.instructions.emplace_back(OP_PUSH_NULL);
-            func.instructions.emplace_back(OP_RET);
+            func.emit(OP_PUSH_NULL);
+            func.emit(OP_RET);
         }
-        SourDoFunction* value = new SourDoFunction(node->parameters.size(), class_context, func);
+        end_function(func);
+        SourDoFunction* value = new(heap) SourDoFunction(node->parameters.size(), class_context, func);
         uint64_t constant = push_constant(value, bytecode);
-        bytecode.instructions.emplace_back(OP_PUSH_FUNC, constant);
+        bytecode.emit(OP_PUSH_FUNC, constant);
     }
 
     void BytecodeGenerator::visit_return_node(std::shared_ptr<ReturnNode> node, Bytecode& bytecode)
     {
         visit_node(node->return_value, bytecode);
         if(error) return;
-        bytecode.instructions.emplace_back(OP_RET);
+        bytecode.emit(OP_RET);
     }
 
     void BytecodeGenerator::visit_break_node(std::shared_ptr<BreakNode> node, Bytecode& bytecode)
@@ -559,7 +908,7 @@ namespace sourdo
             return;
         }
         breaks.emplace_back(bytecode.instructions.size());
-        bytecode.instructions.emplace_back(OP_JMP);
+        bytecode.emit(OP_JMP);
     }
 
     void BytecodeGenerator::visit_continue_node(std::shared_ptr<ContinueNode> node, Bytecode& bytecode)
@@ -572,7 +921,7 @@ namespace sourdo
             return;
         }
         continues.emplace_back(bytecode.instructions.size());
-        bytecode.instructions.emplace_back(OP_JMP);
+        bytecode.emit(OP_JMP);
     }
 
     void BytecodeGenerator::visit_binary_op_node(std::shared_ptr<BinaryOpNode> node, Bytecode& bytecode)
@@ -586,46 +935,46 @@ namespace sourdo
         switch(node->op_token.type)
         {
             case Token::Type::ADD:
-                bytecode.instructions.emplace_back(OP_ADD);
+                bytecode.emit(OP_ADD);
                 break;
             case Token::Type::SUB:
-                bytecode.instructions.emplace_back(OP_SUB);
+                bytecode.emit(OP_SUB);
                 break;
             case Token::Type::MUL:
-                bytecode.instructions.emplace_back(OP_MUL);
+                bytecode.emit(OP_MUL);
                 break;
             case Token::Type::DIV:
-                bytecode.instructions.emplace_back(OP_DIV);
+                bytecode.emit(OP_DIV);
                 break;
             case Token::Type::MOD:
-                bytecode.instructions.emplace_back(OP_MOD);
+                bytecode.emit(OP_MOD);
                 break;
             case Token::Type::POW:
-                bytecode.instructions.emplace_back(OP_POW);
+                bytecode.emit(OP_POW);
                 break;
             case Token::Type::EQUAL:
-                bytecode.instructions.emplace_back(OP_EQ);
+                bytecode.emit(OP_EQ);
                 break;
             case Token::Type::NOT_EQUAL:
-                bytecode.instructions.emplace_back(OP_NE);
+                bytecode.emit(OP_NE);
                 break;
             case Token::Type::LESS_THAN:
-                bytecode.instructions.emplace_back(OP_LT);
+                bytecode.emit(OP_LT);
                 break;
             case Token::Type::GREATER_THAN:
-                bytecode.instructions.emplace_back(OP_GT);
+                bytecode.emit(OP_GT);
                 break;
             case Token::Type::GREATER_EQUAL:
-                bytecode.instructions.emplace_back(OP_GE);
+                bytecode.emit(OP_GE);
                 break;
             case Token::Type::LESS_EQUAL:
-                bytecode.instructions.emplace_back(OP_LE);
+                bytecode.emit(OP_LE);
                 break;
             case Token::Type::AND:
-                bytecode.instructions.emplace_back(OP_AND);
+                bytecode.emit(OP_AND);
                 break;
             case Token::Type::OR:
-                bytecode.instructions.emplace_back(OP_OR);
+                bytecode.emit(OP_OR);
                 break;
             default:
                 break;
@@ -640,10 +989,10 @@ namespace sourdo
         switch(node->op_token.type)
         {
             case Token::Type::SUB:
-                bytecode.instructions.emplace_back(OP_NEG);
+                bytecode.emit(OP_NEG);
                 break;
             case Token::Type::NOT:
-                bytecode.instructions.emplace_back(OP_NOT);
+                bytecode.emit(OP_NOT);
                 break;
             default:
                 break;
@@ -655,12 +1004,11 @@ namespace sourdo
         visit_node(node->left_operand, bytecode);
         if(error) return;
 
-        uint64_t type_name = push_constant(node->right_operand.value, bytecode);
-
-        bytecode.instructions.emplace_back(OP_TYPE_CHECK, type_name);
+        // Type names are resolved to ids here, so the check compares numbers.
+        bytecode.emit(OP_TYPE_CHECK, heap.type_id(node->right_operand.value));
         if(node->invert)
         {
-            bytecode.instructions.emplace_back(OP_NOT);
+            bytecode.emit(OP_NOT);
         }
     }
 
@@ -674,14 +1022,14 @@ namespace sourdo
             visit_node(arg, bytecode);
             if(error) return;
         }
-        bytecode.instructions.emplace_back(Opcode::OP_CALL, node->arguments.size());
+        bytecode.emit(Opcode::OP_CALL, node->arguments.size());
     }
 
     void BytecodeGenerator::visit_index_node(std::shared_ptr<IndexNode> node, Bytecode& bytecode)
     {
         visit_node(node->base, bytecode);
         visit_node(node->attribute, bytecode);
-        bytecode.instructions.emplace_back(OP_VAL_GET);
+        bytecode.emit(OP_VAL_GET, push_property_cache(bytecode));
     }
 
     void BytecodeGenerator::visit_index_call_node(std::shared_ptr<IndexCallNode> node, Bytecode& bytecode)
@@ -692,7 +1040,7 @@ namespace sourdo
         visit_node(node->callee, bytecode);
         if(error) return;
 
-        bytecode.instructions.emplace_back(OP_VAL_GET);
+        bytecode.emit(OP_VAL_GET, push_property_cache(bytecode));
         visit_node(node->base, bytecode);
         if(error) return;
 
@@ -701,50 +1049,61 @@ namespace sourdo
             visit_node(arg, bytecode);
             if(error) return;
         }
-        bytecode.instructions.emplace_back(Opcode::OP_CALL, node->arguments.size() + 1);
+        bytecode.emit(Opcode::OP_CALL, node->arguments.size() + 1);
     }
 
     void BytecodeGenerator::visit_number_node(std::shared_ptr<NumberNode> node, Bytecode& bytecode)
     {
         uint64_t constant = push_constant(std::stod(node->value.value), bytecode);
-        bytecode.instructions.emplace_back(Opcode::OP_PUSH_NUMBER, constant);
+        bytecode.emit(Opcode::OP_PUSH_NUMBER, constant);
     }
 
     void BytecodeGenerator::visit_string_node(std::shared_ptr<StringNode> node, Bytecode& bytecode)
     {
-        uint64_t constant = push_constant(node->value.value, bytecode);
-        bytecode.instructions.emplace_back(Opcode::OP_PUSH_STRING, constant);
+        uint64_t constant = push_string_constant(node->value.value, bytecode);
+        bytecode.emit(Opcode::OP_PUSH_STRING, constant);
     }
 
     void BytecodeGenerator::visit_bool_node(std::shared_ptr<BoolNode> node, Bytecode& bytecode)
     {
-        bytecode.instructions.emplace_back(Opcode::OP_PUSH_BOOL, node->value.type == Token::Type::BOOL_TRUE);
+        bytecode.emit(Opcode::OP_PUSH_BOOL, node->value.type == Token::Type::BOOL_TRUE);
     }
 
     void BytecodeGenerator::visit_null_node(std::shared_ptr<NullNode> node, Bytecode& bytecode)
     {
-        bytecode.instructions.emplace_back(Opcode::OP_PUSH_NULL);
+        bytecode.emit(Opcode::OP_PUSH_NULL);
     }
 
     void BytecodeGenerator::visit_identifier_node(std::shared_ptr<IdentifierNode> node, Bytecode& bytecode)
     {
-        uint64_t constant = push_constant(node->name_tok.value, bytecode);
-        bytecode.instructions.emplace_back(Opcode::OP_SYM_GET, constant);
+        std::optional<Local> local = resolve_local(node->name_tok.value);
+        if(local)
+        {
+            bytecode.emit(Opcode::OP_LOCAL_GET, local->slot);
+            return;
+        }
+        if(is_global_name(node->name_tok.value))
+        {
+            bytecode.emit(Opcode::OP_GLOBAL_GET, push_global_cache(node->name_tok.value, bytecode));
+            return;
+        }
+        uint64_t constant = push_string_constant(node->name_tok.value, bytecode);
+        bytecode.emit(Opcode::OP_SYM_GET, constant);
     }
 
     void BytecodeGenerator::visit_table_node(std::shared_ptr<TableNode> node , Bytecode& bytecode)
     {
-        bytecode.instructions.emplace_back(OP_AlLOC_TABLE);
+        bytecode.emit(OP_AlLOC_TABLE);
         for(auto[k, v] : node->keys)
         {
-            bytecode.instructions.emplace_back(OP_STACK_GET_TOP, 1);
+            bytecode.emit(OP_STACK_GET_TOP, 1);
             visit_node(k, bytecode);
             if(error) return;
 
             visit_node(v, bytecode);
             if(error) return;
             
-            bytecode.instructions.emplace_back(OP_VAL_SET);
+            bytecode.emit(OP_VAL_SET, push_property_cache(bytecode));
         }
     }
 
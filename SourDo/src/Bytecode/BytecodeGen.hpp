@@ -9,9 +9,13 @@
 #include <cstdint>
 #include <memory>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace sourdo
 { 
+    class GarbageCollector;
+
     class BytecodeGenerator
     {
     public:
@@ -21,14 +25,60 @@ namespace sourdo
             std::optional<std::string> error;
         };
 
+        // Constants and functions are created on 'heap'.
+        BytecodeGenerator(GarbageCollector& heap)
+            : heap(heap)
+        {
+        }
+
         Result generate_bytecode(std::shared_ptr<Node> ast);
     private:
+        GarbageCollector& heap;
+        struct Local
+        {
+            uint64_t slot;
+            bool readonly;
+        };
+
+        // What is known about a function (or the main chunk) while its body is being generated.
+        struct FunctionScope
+        {
+            // Innermost block last. A name mapped to no slot lives in the symbol table and hides outer locals.
+            std::vector<std::unordered_map<std::string, std::optional<Local>>> blocks;
+            std::vector<uint64_t> block_starts;
+            uint64_t next_slot = 0;
+            uint64_t slot_count = 0;
+            bool is_main = false;
+        };
+
         std::optional<std::string> error;
         std::vector<uint64_t> breaks;
         std::vector<uint64_t> continues;
         bool in_loop = false;
+        std::vector<FunctionScope> functions;
+        // Names used by some function without declaring them. Variables are looked up through the calling 
+        // scopes at runtime, so locals with these names have to stay in the symbol table.
+        std::unordered_set<std::string> free_names;
+        // Names declared anywhere but the top level of the main chunk. A name that is also free may be
+        // found in a calling scope, every other name that isn't a local can only be a global.
+        std::unordered_set<std::string> local_names;
+
+        void collect_free_names(std::shared_ptr<Node> node, std::unordered_set<std::string>& used, std::unordered_set<std::string>& declared, bool top_level = false);
+        void collect_function_free_names(const std::vector<std::string>& parameters, std::shared_ptr<Node> body);
+
+        void begin_function(const std::vector<std::string>& parameters, Bytecode& bytecode);
+        void end_function(Bytecode& bytecode);
+        void begin_block();
+        void end_block();
+        std::optional<Local> declare_local(const std::string& name, bool readonly);
+        std::optional<Local> resolve_local(const std::string& name);
+        bool is_global_name(const std::string& name);
 
+        uint64_t push_global_cache(const std::string& name, Bytecode& bytecode);
+        uint64_t push_property_cache(Bytecode& bytecode);
         uint64_t push_constant(const Value& val, Bytecode& bytecode);
+        uint64_t push_string_constant(const std::string& text, Bytecode& bytecode);
+        void patch_jump(uint64_t position, uint64_t target, Bytecode& bytecode);
         void fix_control_flows(uint64_t continue_spot, uint64_t break_spot, Bytecode& bytecode);
 
         void visit_node(std::shared_ptr<Node> node, Bytecode& bytecode);
@@ -41,7 +91,7 @@ namespace sourdo
 
         void visit_var_declaration_node(std::shared_ptr<VarDeclarationNode> node, Bytecode& bytecode);
         void visit_assignment_node(std::shared_ptr<AssignmentNode> node, Bytecode& bytecode);
-        void visit_func_node(std::shared_ptr<FuncNode> node, Bytecode& bytecode, const std::optional<std::string>& class_context = {});
+        void visit_func_node(std::shared_ptr<FuncNode> node, Bytecode& bytecode, uint32_t class_context = 0);
         void visit_return_node(std::shared_ptr<ReturnNode> node, Bytecode& bytecode);
         void visit_break_node(std::shared_ptr<BreakNode> node, Bytecode& bytecode);
         void visit_continue_node(std::shared_ptr<ContinueNode> node, Bytecode& bytecode);
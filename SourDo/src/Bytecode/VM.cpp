@@ -52,247 +52,420 @@ namespace sourdo
         return os;
     }
 
-    std::optional<std::string> VirtualMachine::run_bytecode(const Bytecode& bytecode, Data::Impl* data)
+    // Computed gotos are a GCC/Clang extension, other compilers always use the switch.
+    #if defined(SOURDO_COMPUTED_GOTO) && !defined(__GNUC__)
+        #undef SOURDO_COMPUTED_GOTO
+    #endif
+
+    /* With computed gotos every handler jumps straight to the next one through its own indirect branch,
+     * which the branch predictor can track separately. Otherwise handlers go back through the switch.
+     */
+    #ifdef SOURDO_COMPUTED_GOTO
+        #define VM_CASE(op) case op: LABEL_##op
+        #define VM_DISPATCH() \
+            instruction = instructions[ipointer]; \
+            operand = instruction.operand(); \
+            goto *dispatch_table[instruction.op()]
+    #else
+        #define VM_CASE(op) case op
+        #define VM_DISPATCH() continue
+    #endif
+    #define VM_NEXT() ipointer++; VM_DISPATCH()
+
+    std::optional<std::string> VirtualMachine::run_bytecode(size_t entry_depth)
     {
         #define UNPACK_REF(var_name) if(var_name.get_type() == ValueType::VALUE_REF) var_name = *(var_name.to_value_ref())
 
         /* Currently, file positions are not logged in runtime error messages.
-         * This should be fixed by adding some extra debug information in the bytecode.
+         * This should be fixed by adding some extra debug information in the bytecode->
          */
-        while(ipointer < bytecode.instructions.size())
+        const Bytecode* bytecode;
+        const Instruction* instructions;
+        uint64_t ipointer;
+        // The innermost scope, either a block of the running function or the function's own scope.
+        Data::Impl* data;
+        // Where the local slots of the running function live.
+        Data::Impl* frame;
+        uint64_t frame_base;
+        uint64_t operand = 0;
+
+        // Switches to the function on top of the frame stack, at its first instruction.
+        #define VM_ENTER_FRAME() \
+            bytecode = frames.back().bytecode; \
+            instructions = bytecode->instructions.data(); \
+            frame = frames.back().scope; \
+            frame_base = frames.back().frame_base; \
+            data = frame; \
+            ipointer = 0; \
+            current_class_context = frames.back().class_context
+        VM_ENTER_FRAME();
+        Instruction instruction = instructions[ipointer];
+
+    #ifdef SOURDO_COMPUTED_GOTO
+        // Must list a label for every opcode, in the same order as the Opcode enum.
+        static void* dispatch_table[] = {
+            &&LABEL_OP_EXTENDED_ARG,
+            &&LABEL_OP_PUSH_NUMBER, &&LABEL_OP_PUSH_STRING, &&LABEL_OP_PUSH_BOOL, &&LABEL_OP_PUSH_NULL, &&LABEL_OP_PUSH_FUNC,
+            &&LABEL_OP_CREATE_SUBTYPE, &&LABEL_OP_CREATE_TYPE, &&LABEL_OP_SET_SETTER, &&LABEL_OP_SET_GETTER, &&LABEL_OP_SET_METHOD,
+            &&LABEL_OP_SET_CLASS_PROP, &&LABEL_OP_SET_INITIALIZER, &&LABEL_OP_GET_INITIALIZER, &&LABEL_OP_FINISH_TYPE,
+            &&LABEL_OP_ALLOC_OBJECT, &&LABEL_OP_ADD_PROPERTY, &&LABEL_OP_ADD_CONST_PROPERTY,
+            &&LABEL_OP_STACK_GET, &&LABEL_OP_STACK_GET_TOP, &&LABEL_OP_SYM_CREATE, &&LABEL_OP_SYM_CONST, &&LABEL_OP_SYM_GET, &&LABEL_OP_SYM_SET,
+            &&LABEL_OP_LOCAL_GET, &&LABEL_OP_LOCAL_SET, &&LABEL_OP_GLOBAL_GET, &&LABEL_OP_GLOBAL_SET,
+            &&LABEL_OP_AlLOC_TABLE, &&LABEL_OP_VAL_SET, &&LABEL_OP_VAL_GET,
+            &&LABEL_OP_JMP, &&LABEL_OP_NJMP,
+            &&LABEL_OP_PUSH_SCOPE, &&LABEL_OP_POP_SCOPE, &&LABEL_OP_POP, &&LABEL_OP_REMOVE_TOP,
+            &&LABEL_OP_TYPE_CHECK, &&LABEL_OP_ADD, &&LABEL_OP_SUB, &&LABEL_OP_MUL, &&LABEL_OP_DIV, &&LABEL_OP_MOD, &&LABEL_OP_POW, &&LABEL_OP_NEG,
+            &&LABEL_OP_EQ, &&LABEL_OP_NE, &&LABEL_OP_LT, &&LABEL_OP_LE, &&LABEL_OP_GT, &&LABEL_OP_GE,
+            &&LABEL_OP_OR, &&LABEL_OP_AND, &&LABEL_OP_NOT,
+            &&LABEL_OP_CALL, &&LABEL_OP_RET, &&LABEL_OP_HALT,
+        };
+        static_assert(sizeof(dispatch_table) / sizeof(void*) == OP_HALT + 1, "dispatch_table is missing opcodes");
+    #endif
+
+        // Every chunk ends in OP_RET, OP_POP_SCOPE or OP_HALT, so the loop does not need to check for the end of the instructions.
+    resume:
+        while(true)
         {
-            auto& instruction = bytecode.instructions[ipointer];
-            switch(instruction.op)
+            instruction = instructions[ipointer];
+            operand = instruction.operand();
+        dispatch_current:
+        #ifdef SOURDO_COMPUTED_GOTO
+            goto *dispatch_table[instruction.op()];
+        #endif
+            switch(instruction.op())
             {
-                case OP_PUSH_NUMBER:
+                VM_CASE(OP_EXTENDED_ARG):
+                {
+                    // Fold the prefix into the operand of the next instruction and run that instead.
+                    ipointer++;
+                    instruction = instructions[ipointer];
+                    operand = (operand << OPERAND_BITS) | instruction.operand();
+                    goto dispatch_current;
+                }
+                VM_CASE(OP_PUSH_NUMBER):
                 {
-                    data->stack.emplace_back(bytecode.constants[instruction.operand.value()]);
-                    break;
+                    data->stack.emplace_back(bytecode->constants[operand]);
+                    VM_NEXT();
                 }
-                case OP_PUSH_STRING:
+                VM_CASE(OP_PUSH_STRING):
                 {
-                    data->stack.emplace_back(bytecode.constants[instruction.operand.value()]);
-                    break;
+                    data->stack.emplace_back(bytecode->constants[operand]);
+                    VM_NEXT();
                 }
-                case OP_PUSH_BOOL:
+                VM_CASE(OP_PUSH_BOOL):
                 {
-                    data->stack.emplace_back(bytecode.constants[instruction.operand.value()]);
-                    break;
+                    data->stack.emplace_back(operand != 0);
+                    VM_NEXT();
                 }
-                case OP_PUSH_NULL:
+                VM_CASE(OP_PUSH_NULL):
                 {
                     data->stack.emplace_back(Null());
-                    break;
+                    VM_NEXT();
                 }
-                case OP_PUSH_FUNC:
+                VM_CASE(OP_PUSH_FUNC):
                 {
-                    data->stack.emplace_back(bytecode.constants[instruction.operand.value()]);
-                    break;
+                    data->stack.emplace_back(bytecode->constants[operand]);
+                    VM_NEXT();
                 }
-                case OP_CREATE_SUBTYPE:
+                VM_CASE(OP_CREATE_SUBTYPE):
                 {
                     Value& super_type = data->index_stack(-1);
                     if(super_type.get_type() != ValueType::CLASS_TYPE)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): Super value is not a class";
+                        ss << bytecode->file_name << "(Runtime Error): Super value is not a class";
                         return ss.str();
                     }
 
-                    data->stack.emplace_back(new ClassType(
-                        bytecode.constants[instruction.operand.value()].to_string(),
-                        super_type.to_class()
-                    ));
-                    break;
+                    const std::string& name = bytecode->constants[operand].to_string()->text;
+                    ClassType* class_type = new(*data->heap) ClassType(name, data->heap->type_id(name), super_type.to_class());
+                    data->heap->add_class_depth(class_type->id, class_type->ancestors.size() - 1);
+                    data->stack.emplace_back(class_type);
+                    VM_NEXT();
                 }
-                case OP_CREATE_TYPE:
+                VM_CASE(OP_CREATE_TYPE):
                 {
-                    data->stack.emplace_back(new ClassType(bytecode.constants[instruction.operand.value()].to_string(), nullptr) );
-                    break;
+                    const std::string& name = bytecode->constants[operand].to_string()->text;
+                    ClassType* class_type = new(*data->heap) ClassType(name, data->heap->type_id(name), nullptr);
+                    data->heap->add_class_depth(class_type->id, 0);
+                    data->stack.emplace_back(class_type);
+                    VM_NEXT();
                 }
-                case OP_SET_SETTER:
+                VM_CASE(OP_SET_SETTER):
                 {
                     Value& class_type = data->index_stack(-3);
                     if(class_type.to_class()->complete)
                     {
-                        break;
+                        VM_NEXT();
                     }
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
                     
-                    class_type.to_class()->setters[name.to_string()] = ClassType::Property(value, class_type.to_class()->name, instruction.operand.value(), true);
-                    break;
+                    data->heap->snapshot_barrier(class_type);
+                    class_type.to_class()->setters[name.to_string()] = ClassType::Property(value, class_type.to_class()->id, operand, true);
+                    data->heap->write_barrier(class_type, name);
+                    data->heap->write_barrier(class_type, value);
+                    VM_NEXT();
                 }
-                case OP_SET_GETTER:
+                VM_CASE(OP_SET_GETTER):
                 {
                     Value& class_type = data->index_stack(-3);
                     if(class_type.to_class()->complete)
                     {
-                        break;
+                        VM_NEXT();
                     }
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
 
-                    class_type.to_class()->getters[name.to_string()] = ClassType::Property(value, class_type.to_class()->name, instruction.operand.value(), true);
-                    break;
+                    data->heap->snapshot_barrier(class_type);
+                    class_type.to_class()->getters[name.to_string()] = ClassType::Property(value, class_type.to_class()->id, operand, true);
+                    data->heap->write_barrier(class_type, name);
+                    data->heap->write_barrier(class_type, value);
+                    VM_NEXT();
                 }
-                case OP_SET_METHOD:
+                VM_CASE(OP_SET_METHOD):
                 {
                     Value& class_type = data->index_stack(-3);
                     if(class_type.to_class()->complete)
                     {
-                        break;
+                        VM_NEXT();
                     }
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
 
-                    class_type.to_class()->methods[name.to_string()] = ClassType::Property(value, class_type.to_class()->name, instruction.operand.value(), true);
-                    break;
+                    data->heap->snapshot_barrier(class_type);
+                    class_type.to_class()->methods[name.to_string()] = ClassType::Property(value, class_type.to_class()->id, operand, true);
+                    data->heap->write_barrier(class_type, name);
+                    data->heap->write_barrier(class_type, value);
+                    VM_NEXT();
                 }
-                case OP_SET_CLASS_PROP:
+                VM_CASE(OP_SET_CLASS_PROP):
                 {
                     Value& class_type = data->index_stack(-3);
                     if(class_type.to_class()->complete)
                     {
-                        break;
+                        VM_NEXT();
                     }
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
                     
-                    class_type.to_class()->class_methods[name.to_string()] = ClassType::Property(value, class_type.to_class()->name, false, true);
-                    break;
+                    data->heap->snapshot_barrier(class_type);
+                    class_type.to_class()->class_methods[name.to_string()] = ClassType::Property(value, class_type.to_class()->id, false, true);
+                    data->heap->write_barrier(class_type, name);
+                    data->heap->write_barrier(class_type, value);
+                    VM_NEXT();
                 }
-                case OP_SET_INITIALIZER:
+                VM_CASE(OP_SET_INITIALIZER):
                 {
                     Value& class_type = data->index_stack(-2);
                     if(class_type.to_class()->complete)
                     {
-                        break;
+                        VM_NEXT();
                     }
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
 
+                    data->heap->snapshot_barrier(class_type);
                     class_type.to_class()->initializer = value.to_sourdo_function();
-                    break;
+                    data->heap->write_barrier(class_type, value);
+                    VM_NEXT();
                 }
-                case OP_GET_INITIALIZER:
+                VM_CASE(OP_GET_INITIALIZER):
                 {
                     Value& class_type = data->index_stack(-1);
                     data->stack.emplace_back(class_type.to_class()->initializer);
-                    break;
+                    VM_NEXT();
                 }
-                case OP_FINISH_TYPE:
+                VM_CASE(OP_FINISH_TYPE):
                 {
-                    data->index_stack(-1).to_class()->complete = true;
-                    break;
+                    ClassType* class_type = data->index_stack(-1).to_class();
+                    class_type->build_members();
+                    class_type->complete = true;
+                    VM_NEXT();
                 }
-                case OP_ALLOC_OBJECT:
+                VM_CASE(OP_ALLOC_OBJECT):
                 {
                     Value& type = data->index_stack(-1);
 
-                    data->stack.emplace_back(new Object(type.to_class()));
-                    break;
+                    data->stack.emplace_back(new(*data->heap) Object(*data->heap, type.to_class()));
+                    VM_NEXT();
                 }
-                case OP_ADD_PROPERTY:
+                VM_CASE(OP_ADD_PROPERTY):
                 {
-                    Value& object = data->index_stack(-4);
-                    std::string class_context = data->index_stack(-3).to_string();
+                    Value& object = data->index_stack(-3);
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
-                    data->stack.pop_back();
-                    object.to_object()->props[name.to_string()] = ClassType::Property(value, class_context, instruction.operand.value(), false);
-                    break;
+                    // New shapes are stored in the class.
+                    Value type = object.to_object()->type;
+                    data->heap->snapshot_barrier(object);
+                    data->heap->snapshot_barrier(type);
+                    object.to_object()->add_property(name.to_string(), value, current_class_context, operand, false);
+                    data->heap->write_barrier(type, name);
+                    data->heap->write_barrier(object, value);
+                    VM_NEXT();
                 }
-                case OP_ADD_CONST_PROPERTY:
+                VM_CASE(OP_ADD_CONST_PROPERTY):
                 {
-                    Value& object = data->index_stack(-4);
-                    std::string class_context = data->index_stack(-3).to_string();
+                    Value& object = data->index_stack(-3);
                     Value name = data->index_stack(-2);
                     Value value = data->index_stack(-1);
                     data->stack.pop_back();
                     data->stack.pop_back();
-                    data->stack.pop_back();
-                    object.to_object()->props[name.to_string()] = ClassType::Property(value, class_context, instruction.operand.value(), true);
-                    break;
+                    // New shapes are stored in the class.
+                    Value type = object.to_object()->type;
+                    data->heap->snapshot_barrier(object);
+                    data->heap->snapshot_barrier(type);
+                    object.to_object()->add_property(name.to_string(), value, current_class_context, operand, true);
+                    data->heap->write_barrier(type, name);
+                    data->heap->write_barrier(object, value);
+                    VM_NEXT();
                 }
-                case OP_STACK_GET:
+                VM_CASE(OP_STACK_GET):
                 {
-                    data->stack.emplace_back(data->index_stack(instruction.operand.value()));
-                    break;
+                    data->stack.emplace_back(data->index_stack(operand));
+                    VM_NEXT();
                 }
-                case OP_STACK_GET_TOP:
+                VM_CASE(OP_STACK_GET_TOP):
                 {
-                    data->stack.emplace_back(data->index_stack(-instruction.operand.value()));
-                    break;
+                    data->stack.emplace_back(data->index_stack(-operand));
+                    VM_NEXT();
                 }
-                case OP_SYM_CREATE:
-                case OP_SYM_CONST:
+                VM_CASE(OP_SYM_CREATE):
+                VM_CASE(OP_SYM_CONST):
                 {
                     Value initializer = data->index_stack(-1);
                     data->stack.pop_back();
-                    uint64_t sym_name = instruction.operand.value();
-                    if(data->symbol_table.find(bytecode.constants[sym_name].to_string()) != data->symbol_table.end())
+                    uint64_t sym_name = operand;
+                    if(data->find_symbol(bytecode->constants[sym_name].to_string()) != nullptr)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): '" << bytecode.constants[sym_name].to_string() << "' is already defined";
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[sym_name].to_string()->text << "' is already defined";
                         return ss.str();
                     }
-                    data->symbol_table[bytecode.constants[sym_name].to_string()] = {instruction.op == OP_SYM_CONST, 
+                    data->create_symbol(bytecode->constants[sym_name].to_string()) = {instruction.op() == OP_SYM_CONST, 
                             initializer.get_type() == ValueType::VALUE_REF ? *(initializer.to_value_ref()) : initializer };
-                    break;
+                    VM_NEXT();
                 }
-                case OP_SYM_GET:
+                VM_CASE(OP_SYM_GET):
                 {
-                    uint64_t sym_name = instruction.operand.value();
-                    std::optional<Value> value = data->get_symbol(bytecode.constants[sym_name].to_string());
+                    uint64_t sym_name = operand;
+                    std::optional<Value> value = data->get_symbol(bytecode->constants[sym_name].to_string());
                     if(!value)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): '" << bytecode.constants[sym_name].to_string() << "' is undefined";
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[sym_name].to_string()->text << "' is undefined";
                         return ss.str();
                     }
                     data->stack.emplace_back(*value);
-                    break;
+                    VM_NEXT();
                 }
-                case OP_SYM_SET:
+                VM_CASE(OP_SYM_SET):
                 {
-                    uint64_t sym_name = instruction.operand.value();
-                    std::string str_name = bytecode.constants[sym_name].to_string();
+                    uint64_t sym_name = operand;
                     Value new_value = data->index_stack(-1);
                     data->stack.pop_back();
 
-                    SetSymbolResult res = data->set_symbol(bytecode.constants[sym_name].to_string(), 
+                    SetSymbolResult res = data->set_symbol(bytecode->constants[sym_name].to_string(), 
                             new_value.get_type() == ValueType::VALUE_REF ? *(new_value.to_value_ref()) : new_value );
                     if(res == SetSymbolResult::SYM_NOT_FOUND)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): '" << bytecode.constants[sym_name].to_string() << "' is undefined";
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[sym_name].to_string()->text << "' is undefined";
+                        return ss.str();
+                    }
+                    else if(res == SetSymbolResult::SYM_READONLY)
+                    {
+                        std::stringstream ss;
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[sym_name].to_string()->text << "' is a constant";
+                        return ss.str();
+                    }
+                    VM_NEXT();
+                }
+                VM_CASE(OP_LOCAL_GET):
+                {
+                    Value value = frame->stack[frame_base + operand];
+                    data->stack.emplace_back(value);
+                    VM_NEXT();
+                }
+                VM_CASE(OP_LOCAL_SET):
+                {
+                    Value new_value = data->index_stack(-1);
+                    UNPACK_REF(new_value);
+                    data->stack.pop_back();
+                    frame->stack[frame_base + operand] = new_value;
+                    VM_NEXT();
+                }
+                VM_CASE(OP_GLOBAL_GET):
+                {
+                    Bytecode::GlobalCache& cache = bytecode->global_caches[operand];
+                    if(cache.version == root->globals_version || cache_global_slot(*bytecode, cache))
+                    {
+                        data->stack.emplace_back(root->globals[cache.slot].val);
+                        VM_NEXT();
+                    }
+                    // Not a global, the name may still be defined in a scope above this one.
+                    std::optional<Value> value = data->get_symbol(bytecode->constants[cache.name].to_string());
+                    if(!value)
+                    {
+                        std::stringstream ss;
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[cache.name].to_string()->text << "' is undefined";
+                        return ss.str();
+                    }
+                    data->stack.emplace_back(*value);
+                    VM_NEXT();
+                }
+                VM_CASE(OP_GLOBAL_SET):
+                {
+                    Bytecode::GlobalCache& cache = bytecode->global_caches[operand];
+                    Value new_value = data->index_stack(-1);
+                    UNPACK_REF(new_value);
+                    data->stack.pop_back();
+
+                    SetSymbolResult res;
+                    if(cache.version == root->globals_version || cache_global_slot(*bytecode, cache))
+                    {
+                        Symbol& symbol = root->globals[cache.slot];
+                        res = symbol.readonly ? SetSymbolResult::SYM_READONLY : SetSymbolResult::SUCCESS;
+                        if(!symbol.readonly)
+                        {
+                            symbol.val = new_value;
+                        }
+                    }
+                    else
+                    {
+                        res = data->set_symbol(bytecode->constants[cache.name].to_string(), new_value);
+                    }
+
+                    if(res == SetSymbolResult::SYM_NOT_FOUND)
+                    {
+                        std::stringstream ss;
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[cache.name].to_string()->text << "' is undefined";
                         return ss.str();
                     }
                     else if(res == SetSymbolResult::SYM_READONLY)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): '" << bytecode.constants[sym_name].to_string() << "' is a constant";
+                        ss << bytecode->file_name << "(Runtime Error): '" << bytecode->constants[cache.name].to_string()->text << "' is a constant";
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_AlLOC_TABLE:
+                VM_CASE(OP_AlLOC_TABLE):
                 {
-                    data->stack.emplace_back(new Table());
-                    break;
+                    data->stack.emplace_back(new(*data->heap) Table(*data->heap));
+                    VM_NEXT();
                 }
-                case OP_VAL_SET:
+                VM_CASE(OP_VAL_SET):
                 {
                     Value val = data->index_stack(-1);
                     UNPACK_REF(val);
@@ -310,19 +483,22 @@ namespace sourdo
                             if(key.get_type() == ValueType::STRING)
                             {
                                 ClassType* class_type = object->to_class();
-                                if(class_type->class_methods.find(key.to_string()) != class_type->class_methods.end())
+                                ClassType::Member* member = class_type->find_member(data->heap->intern_string(key.to_string()));
+                                if(member != nullptr && member->class_method != nullptr)
                                 {
-                                    if(class_type->class_methods[key.to_string()].readonly)
+                                    if(member->class_method->readonly)
                                     {
                                         std::stringstream ss;
-                                        ss << "(Runtime Error): Cannot alter the const property '" << key.to_string() << "' of class '" << class_type->name << "'";
+                                        ss << "(Runtime Error): Cannot alter the const property '" << key.to_string()->text << "' of class '" << class_type->name << "'";
                                         return ss.str();
                                     }
-                                    class_type->class_methods[key.to_string()].val = val.get_type() == ValueType::VALUE_REF? *(val.to_value_ref()) : val;;
+                                    data->heap->snapshot_barrier(*object);
+                                    member->class_method->val = val.get_type() == ValueType::VALUE_REF? *(val.to_value_ref()) : val;;
+                                    data->heap->write_barrier(*object, val);
                                     break;
                                 }
                                 std::stringstream ss;
-                                ss << "(Runtime Error): '" << key.to_string() << "' does not exist in class '" << class_type->name << "'";
+                                ss << "(Runtime Error): '" << key.to_string()->text << "' does not exist in class '" << class_type->name << "'";
                                 return ss.str();
                                 break;
                             }
@@ -335,89 +511,67 @@ namespace sourdo
                         case ValueType::OBJECT:
                         {
                             Object* obj = object->to_object();
-                            if(key.get_type() == ValueType::STRING)
+                            if(key.get_type() != ValueType::STRING)
                             {
-                                std::string name = key.to_string();
-                                auto it = obj->props.find(name);
-                                if(it != obj->props.end())
-                                {
-                                    if(obj->props[it->first].is_private && current_class_context != it->second.class_context)
-                                    {
-                                        std::stringstream ss;
-                                        ss << "(Runtime Error): Cannot access the private property '" << name << "' outside of the class it is defined in";
-                                        return ss.str();
-                                    }
-
-                                    obj->props[it->first].val = val;
-                                    break;
-                                }
-
-                                ClassType* current_type = obj->type;
-                                bool value_is_found = false;
-                                while(current_type != nullptr)
-                                {
-                                    it = current_type->setters.find(name);
-                                    if(it != current_type->setters.end())
-                                    {
-                                        if(current_type->setters[it->first].is_private && current_class_context != it->second.class_context)
-                                        {
-                                            std::stringstream ss;
-                                            ss << "(Runtime Error): Cannot access the private setter '" << name << "' outside of the class it is defined in";
-                                            return ss.str();
-                                        }
-                                        data->stack.emplace_back(current_type->setters[it->first].val);
-                                        data->stack.emplace_back(obj);
-                                        data->stack.emplace_back(val);
-                                        std::optional<std::string> error = call_function(bytecode, data, 2);
-                                        if(error)
-                                        {
-                                            return error;
-                                        }
-                                        value_is_found = true;
-                                        break;
-                                    }
-
-                                    it = current_type->methods.find(name);
-                                    if(it != current_type->methods.end())
-                                    {
-                                        std::stringstream ss;
-                                        if(current_type->methods[it->first].is_private && current_class_context != it->second.class_context)
-                                        {
-                                            ss << "(Runtime Error): Cannot access the private method '" << name << "' outside of the class it is defined in";
-                                            return ss.str();
-                                        }
-
-                                        ss << "(Runtime Error): Cannot set the value of '" << name << "' as it is defined as a method'";
-                                        return ss.str();
-                                    }
-                                    current_type = current_type->super;
-                                    break;
-                                }
+                                std::stringstream ss;
+                                ss << "(Runtime Error): Cannot index an object with a value of type " << key.get_type();
+                                return ss.str();
+                            }
 
-                                if(value_is_found)
+                            Bytecode::PropertyCache& cache = bytecode->property_caches[operand];
+                            const Bytecode::PropertyCache::Entry* member = cache.find(obj->shape->id, key.to_string());
+                            Bytecode::PropertyCache::Entry resolved;
+                            if(member != nullptr && (member->class_context == 0 || member->class_context == current_class_context))
+                            {
+                                root->inline_cache_stats.hits++;
+                            }
+                            else
+                            {
+                                root->inline_cache_stats.misses++;
+                                String* name = data->heap->intern_string(key.to_string());
+                                std::optional<std::string> error = resolve_set(obj, name, resolved);
+                                if(error)
                                 {
-                                    break;
+                                    return error;
                                 }
-
-                                std::stringstream ss;
-                                ss << "(Runtime Error): '" << name << "' does not exist in object of type '" << obj->type->name << "'";
-                                return ss.str();
+                                member = &cache.insert(resolved);
                             }
 
-                            std::stringstream ss;
-                            ss << "(Runtime Error): Cannot index an object with a value of type " << key.get_type();
-                            return ss.str();
+                            if(member->kind == Bytecode::PropertyCache::Kind::SLOT)
+                            {
+                                data->heap->snapshot_barrier(*object);
+                                obj->slots[member->slot] = val;
+                                data->heap->write_barrier(*object, val);
+                                break;
+                            }
+                            data->stack.emplace_back(*member->member);
+                            data->stack.emplace_back(obj);
+                            data->stack.emplace_back(val);
+                            size_t depth = frames.size();
+                            std::optional<std::string> error = call_function(*bytecode, data, 2, ipointer + 1);
+                            if(error)
+                            {
+                                return error;
+                            }
+                            if(frames.size() != depth)
+                            {
+                                VM_ENTER_FRAME();
+                                goto resume;
+                            }
                             break;
                         }
                         case ValueType::TABLE:
                         {
-                            if(key.get_type() == ValueType::STRING && key.to_string() == "has")
+                            if(key.get_type() == ValueType::STRING && key.to_string()->text == "has")
                             {
                                 std::stringstream ss;
                                 ss << "(Runtime Error): 'has' is a built-in method for tables and cannot be changed";
                                 return ss.str();
                             }
+                            data->heap->snapshot_barrier(*object);
                             object->to_table()->keys[key] = val.get_type() == ValueType::VALUE_REF? *(val.to_value_ref()) : val;;
+                            data->heap->write_barrier(*object, key);
+                            data->heap->write_barrier(*object, val);
                             break;
                         }
                         case ValueType::STRING:
@@ -431,7 +585,7 @@ namespace sourdo
                             if(key.get_type() == ValueType::STRING)
                             {
                                 std::stringstream ss;
-                                ss << "(Runtime Error): '" << key.to_string() << "' does not exist in string";
+                                ss << "(Runtime Error): '" << key.to_string()->text << "' does not exist in string";
                                 return ss.str();
                             }
                             std::stringstream ss;
@@ -447,9 +601,9 @@ namespace sourdo
                             break;
                         }
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_VAL_GET:
+                VM_CASE(OP_VAL_GET):
                 {
                     Value key = data->index_stack(-1);
                     UNPACK_REF(key);
@@ -464,13 +618,14 @@ namespace sourdo
                             if(key.get_type() == ValueType::STRING)
                             {
                                 ClassType* class_type = object->to_class();
-                                if(class_type->class_methods.find(key.to_string()) != class_type->class_methods.end())
+                                ClassType::Member* member = class_type->find_member(data->heap->intern_string(key.to_string()));
+                                if(member != nullptr && member->class_method != nullptr)
                                 {
-                                    data->stack.emplace_back( &(class_type->class_methods[key.to_string()].val) );
+                                    data->stack.emplace_back(&member->class_method->val);
                                     break;
                                 }
                                 std::stringstream ss;
-                                ss << "(Runtime Error): '" << key.to_string() << "' does not exist in class '" << class_type->name << "'";
+                                ss << "(Runtime Error): '" << key.to_string()->text << "' does not exist in class '" << class_type->name << "'";
                                 return ss.str();
                                 break;
                             }
@@ -483,84 +638,69 @@ namespace sourdo
                         case ValueType::OBJECT:
                         {
                             Object* obj = object->to_object();
-                            if(key.get_type() == ValueType::STRING)
+                            if(key.get_type() != ValueType::STRING)
                             {
-                                std::string name = key.to_string();
-                                auto it = obj->props.find(name);
-                                if(it != obj->props.end())
-                                {
-                                    if(obj->props[it->first].is_private && current_class_context != it->second.class_context)
-                                    {
-                                        std::stringstream ss;
-                                        ss << "(Runtime Error): Cannot access the private property '" << name << "' outside of the class it is defined in";
-                                        return ss.str();
-                                    }
+                                std::stringstream ss;
+                                ss << "(Runtime Error): Cannot index an object with a value of type " << key.get_type();
+                                return ss.str();
+                            }
 
-                                    data->stack.emplace_back(&(obj->props[it->first].val));
-                                    break;
+                            Bytecode::PropertyCache& cache = bytecode->property_caches[operand];
+                            const Bytecode::PropertyCache::Entry* member = cache.find(obj->shape->id, key.to_string());
+                            Bytecode::PropertyCache::Entry resolved;
+                            if(member != nullptr && (member->class_context == 0 || member->class_context == current_class_context))
+                            {
+                                root->inline_cache_stats.hits++;
+                            }
+                            else
+                            {
+                                root->inline_cache_stats.misses++;
+                                String* name = data->heap->intern_string(key.to_string());
+                                std::optional<std::string> error = resolve_get(obj, name, resolved);
+                                if(error)
+                                {
+                                    return error;
                                 }
+                                member = &cache.insert(resolved);
+                            }
 
-                                ClassType* current_type = obj->type;
-                                bool value_is_found = false;
-                                while(current_type != nullptr)
+                            switch(member->kind)
+                            {
+                                case Bytecode::PropertyCache::Kind::SLOT:
+                                    data->stack.emplace_back(&obj->slots[member->slot]);
+                                    break;
+                                case Bytecode::PropertyCache::Kind::METHOD:
+                                    data->stack.emplace_back(member->member);
+                                    break;
+                                default:
                                 {
-                                    it = current_type->getters.find(name);
-                                    if(it != current_type->getters.end())
+                                    data->stack.emplace_back(*member->member);
+                                    data->stack.emplace_back(obj);
+                                    size_t depth = frames.size();
+                                    std::optional<std::string> error = call_function(*bytecode, data, 1, ipointer + 1);
+                                    if(error)
                                     {
-                                        if(current_type->getters[it->first].is_private && current_class_context != it->second.class_context)
-                                        {
-                                            std::stringstream ss;
-                                            ss << "(Runtime Error): Cannot access the private getter '" << name << "' outside of the class it is defined in";
-                                            return ss.str();
-                                        }
-                                        data->stack.emplace_back(current_type->getters[it->first].val);
-                                        data->stack.emplace_back(obj);
-                                        std::optional<std::string> error = call_function(bytecode, data, 1);
-                                        if(error)
-                                        {
-                                            return error;
-                                        }
-                                        value_is_found = true;
-                                        break;
+                                        return error;
                                     }
-
-                                    it = current_type->methods.find(name);
-                                    if(it != current_type->methods.end())
+                                    if(frames.size() != depth)
                                     {
-                                        if(current_type->methods[it->first].is_private && current_class_context != it->second.class_context)
-                                        {
-                                            std::stringstream ss;
-                                            ss << "(Runtime Error): Cannot access the private method '" << name << "' outside of the class it is defined in";
-                                            return ss.str();
-                                        }
-                                        data->stack.emplace_back(&(current_type->methods[it->first].val));
-                                        value_is_found = true;
-                                        break;
+                                        VM_ENTER_FRAME();
+                                        goto resume;
                                     }
-                                    current_type = current_type->super;
-                                }
-                                if(value_is_found)
-                                {
                                     break;
                                 }
-
-                                std::stringstream ss;
-                                ss << "(Runtime Error): '" << name << "' does not exist in object of type '" << obj->type->name << "'";
-                                return ss.str();
                             }
-
-                            std::stringstream ss;
-                            ss << "(Runtime Error): Cannot index an object with a value of type " << key.get_type();
-                            return ss.str();
                             break;
                         }
                         case ValueType::TABLE:
                         {
-                            if(key.get_type() == ValueType::STRING && key.to_string() == "has")
+                            if(key.get_type() == ValueType::STRING && key.to_string()->text == "has")
                             {
                                 data->stack.emplace_back(table_has);
                                 break;
                             }
+                            // Creates the entry if it's missing.
+                            data->heap->snapshot_barrier(*object);
                             data->stack.emplace_back( &(object->to_table()->keys[key]) );
                             break;
                         }
@@ -568,14 +708,14 @@ namespace sourdo
                         {
                             if(key.get_type() == ValueType::STRING)
                             {
-                                if(key.to_string() == "length")
+                                if(key.to_string()->text == "length")
                                 {
                                     data->stack.emplace_back(string_length);
                                 }
                                 else
                                 {
                                     std::stringstream ss;
-                                    ss << "(Runtime Error): '" << key.to_string() << "' does not exist in string";
+                                    ss << "(Runtime Error): '" << key.to_string()->text << "' does not exist in string";
                                     return ss.str();
                                 }
                             }
@@ -588,7 +728,7 @@ namespace sourdo
                                     ss << "(Runtime Error): Index is less than 0";
                                     return ss.str();
                                 }
-                                else if(num > object->to_string().size())
+                                else if(num > object->to_string()->text.size())
                                 {
                                     std::stringstream ss;
                                     ss << "(Runtime Error): Index is greater than the string length";
@@ -596,7 +736,7 @@ namespace sourdo
                                 }
                                 else
                                 {
-                                    data->stack.emplace_back(std::string(1, object->to_string()[num]));
+                                    data->stack.emplace_back(data->heap->create_string(std::string(1, object->to_string()->text[num])));
                                 }
                             }
                             std::stringstream ss;
@@ -612,72 +752,61 @@ namespace sourdo
                             break;
                         }
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_JMP:
+                VM_CASE(OP_JMP):
                 {
-                    ipointer = instruction.operand.value();
-                    continue;
+                    ipointer = operand;
+                    VM_DISPATCH();
                 }
-                case OP_NJMP:
+                VM_CASE(OP_NJMP):
                 {
                     if(data->index_stack(-1).get_type() != ValueType::BOOL)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): Expression does not evaluate to true";
+                        ss << bytecode->file_name << "(Runtime Error): Expression does not evaluate to true";
                         return ss.str();
                     }
 
                     if(!data->index_stack(-1).to_bool())
                     {
-                        ipointer = instruction.operand.value();
+                        ipointer = operand;
                         data->stack.pop_back();
-                        continue;
+                        VM_DISPATCH();
                     }
                     data->stack.pop_back();
-                    break;
+                    VM_NEXT();
                 }
-                case OP_PUSH_SCOPE:
+                VM_CASE(OP_PUSH_SCOPE):
                 {
-                    Data scope;
-                    scope.get_impl()->parent = data;
-                    ipointer++;
-                    std::optional<std::string> error = run_bytecode(bytecode, scope.get_impl());
-                    if(error)
-                    {
-                        return error;
-                    }
-                    if(returning)
-                    {
-                        data->stack.emplace_back(scope.get_impl()->index_stack(-1));
-                    }
-                    break;
+                    data = root->push_scope(data).get_impl();
+                    VM_NEXT();
                 }
-                case OP_POP_SCOPE:
+                VM_CASE(OP_POP_SCOPE):
                 {
-                    GarbageCollector::collect_garbage(data);
-                    return {};
-                    break;
+                    data->heap->collect_if_needed(data);
+                    data = data->parent;
+                    root->pop_scope();
+                    VM_NEXT();
                 }
-                case OP_TYPE_CHECK:
+                VM_CASE(OP_TYPE_CHECK):
                 {
                     Value val = data->index_stack(-1);
                     data->stack.pop_back();
-                    std::string type = bytecode.constants[instruction.operand.value()].to_string();
-                    data->stack.emplace_back(check_value_type(val, type));
-                    break;
+                    data->stack.emplace_back(check_value_type(val, operand, *data->heap));
+                    VM_NEXT();
                 }
-                case OP_POP:
+                VM_CASE(OP_POP):
                 {
                     data->stack.pop_back();
-                    break;
+                    VM_NEXT();
                 }
-                case OP_REMOVE_TOP:
+                VM_CASE(OP_REMOVE_TOP):
                 {
-                    data->stack.erase(data->stack.begin() + (data->stack.size() - instruction.operand.value() ) );
-                    break;
+                    data->stack.erase(data->stack.begin() + (data->stack.size() - operand ) );
+                    VM_NEXT();
                 }
-                case OP_ADD:
+                VM_CASE(OP_ADD):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -693,7 +822,7 @@ namespace sourdo
                     else if(left.get_type() == ValueType::STRING && 
                             right.get_type() == ValueType::STRING)
                     {
-                        data->stack.emplace_back(left.to_string() + right.to_string());
+                        data->stack.emplace_back(data->heap->create_string(left.to_string()->text + right.to_string()->text));
                     }
                     else
                     {
@@ -702,9 +831,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_SUB:
+                VM_CASE(OP_SUB):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -724,9 +853,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_MUL:
+                VM_CASE(OP_MUL):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -746,9 +875,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_DIV:
+                VM_CASE(OP_DIV):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -762,7 +891,7 @@ namespace sourdo
                         if(right.to_number() == 0)
                         {
                             std::stringstream ss;
-                            ss << bytecode.file_name << "(Runtime Error): Cannot divide a number by zero";
+                            ss << bytecode->file_name << "(Runtime Error): Cannot divide a number by zero";
                             return ss.str();
                         }
                         data->stack.emplace_back(left.to_number() / right.to_number());
@@ -774,9 +903,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_MOD:
+                VM_CASE(OP_MOD):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -797,9 +926,9 @@ namespace sourdo
                         return ss.str();
                     }
                     
-                    break;
+                    VM_NEXT();
                 }
-                case OP_POW:
+                VM_CASE(OP_POW):
                 {
                     Value right = data->index_stack(-1).to_number();
                     UNPACK_REF(right);
@@ -819,27 +948,27 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_NEG:
+                VM_CASE(OP_NEG):
                 {
-                    Value operand = data->index_stack(-1);
-                    UNPACK_REF(operand);
+                    Value val = data->index_stack(-1);
+                    UNPACK_REF(val);
                     data->stack.pop_back();
-                    if(operand.get_type() == ValueType::NUMBER)
+                    if(val.get_type() == ValueType::NUMBER)
                     {
-                        data->stack.emplace_back(-operand.to_number());
+                        data->stack.emplace_back(-val.to_number());
                     }
                     else
                     {
                         std::stringstream ss;
                         ss << "(Runtime Error): Cannot perform negation with value of type " 
-                                << operand.get_type();
+                                << val.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_EQ:
+                VM_CASE(OP_EQ):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -852,6 +981,11 @@ namespace sourdo
                     {
                         data->stack.emplace_back(left.to_number() == right.to_number());
                     }
+                    else if(left.get_type() == ValueType::STRING && 
+                            right.get_type() == ValueType::STRING)
+                    {
+                        data->stack.emplace_back(strings_equal(left.to_string(), right.to_string()));
+                    }
                     else if(left.get_type() == ValueType::_NULL || 
                             right.get_type() == ValueType::_NULL)
                     {
@@ -864,9 +998,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_NE:
+                VM_CASE(OP_NE):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -877,7 +1011,12 @@ namespace sourdo
                     if(left.get_type() == ValueType::NUMBER && 
                             right.get_type() == ValueType::NUMBER)
                     {
-                        data->stack.emplace_back(left.to_number() == right.to_number());
+                        data->stack.emplace_back(left.to_number() != right.to_number());
+                    }
+                    else if(left.get_type() == ValueType::STRING && 
+                            right.get_type() == ValueType::STRING)
+                    {
+                        data->stack.emplace_back(!strings_equal(left.to_string(), right.to_string()));
                     }
                     else if(left.get_type() == ValueType::_NULL || 
                             right.get_type() == ValueType::_NULL)
@@ -891,9 +1030,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_LT:
+                VM_CASE(OP_LT):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -913,9 +1052,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_LE:
+                VM_CASE(OP_LE):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -935,9 +1074,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_GT:
+                VM_CASE(OP_GT):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -957,9 +1096,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_GE:
+                VM_CASE(OP_GE):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -979,9 +1118,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_OR:
+                VM_CASE(OP_OR):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -1001,9 +1140,9 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_AND:
+                VM_CASE(OP_AND):
                 {
                     Value right = data->index_stack(-1);
                     UNPACK_REF(right);
@@ -1023,70 +1162,243 @@ namespace sourdo
                                 << left.get_type() << " and " << right.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_NOT:
+                VM_CASE(OP_NOT):
                 {
-                    Value operand = data->index_stack(-1);
-                    UNPACK_REF(operand);
+                    Value val = data->index_stack(-1);
+                    UNPACK_REF(val);
                     data->stack.pop_back();
-                    if(operand.get_type() == ValueType::BOOL)
+                    if(val.get_type() == ValueType::BOOL)
                     {
-                        data->stack.emplace_back(!operand.to_bool());
+                        data->stack.emplace_back(!val.to_bool());
                     }
                     else
                     {
                         std::stringstream ss;
                         ss << "(Runtime Error): Cannot perform logical operation (not) with value of type " 
-                                << operand.get_type();
+                                << val.get_type();
                         return ss.str();
                     }
-                    break;
+                    VM_NEXT();
                 }
-                case OP_CALL:
+                VM_CASE(OP_CALL):
                 {
-                    uint64_t arg_count = instruction.operand.value();
-                    std::optional<std::string> error = call_function(bytecode, data, arg_count);
+                    uint64_t arg_count = operand;
+                    size_t depth = frames.size();
+                    std::optional<std::string> error = call_function(*bytecode, data, arg_count, ipointer + 1);
                     if(error)
                     {
                         return error;
                     }
-
-                    break;
+                    if(frames.size() != depth)
+                    {
+                        VM_ENTER_FRAME();
+                        VM_DISPATCH();
+                    }
+                    VM_NEXT();
                 }
-                case OP_RET:
+                VM_CASE(OP_RET):
                 {
-                    if(!is_function)
+                    CallFrame& returning = frames.back();
+                    if(!returning.is_function)
                     {
                         std::stringstream ss;
-                        ss << bytecode.file_name << "(Runtime Error): Cannot return when outside of a function";
+                        ss << bytecode->file_name << "(Runtime Error): Cannot return when outside of a function";
                         return ss.str();
                     }
-                    returning = true;
+                    Value result = data->index_stack(-1);
+                    // Leaves the blocks the return happened in, and the function's own scope unless it was entered from outside the loop.
+                    root->pop_scopes(returning.scope_depth);
+                    if(frames.size() == entry_depth)
+                    {
+                        returning.scope->stack.emplace_back(result);
+                        return {};
+                    }
+
+                    data = returning.caller;
+                    ipointer = returning.return_address;
+                    frames.pop_back();
+                    root->call_depth--;
+                    // The function value sits right below the arguments, the result takes its place.
+                    data->stack.back() = result;
+                    data->heap->collect_if_needed(data);
+
+                    bytecode = frames.back().bytecode;
+                    instructions = bytecode->instructions.data();
+                    frame = frames.back().scope;
+                    frame_base = frames.back().frame_base;
+                    current_class_context = frames.back().class_context;
+                    VM_DISPATCH();
+                }
+                VM_CASE(OP_HALT):
+                {
+                    // Blocks that were left with a jump may still be open.
+                    root->pop_scopes(frames.back().scope_depth);
                     return {};
-                    break;
                 }
             }
             ipointer++;
         }
-        return {};
     }
 
-    std::optional<std::string> VirtualMachine::call_function(const Bytecode& bytecode, Data::Impl* data, uint64_t arg_count)
+    bool VirtualMachine::cache_global_slot(const Bytecode& bytecode, Bytecode::GlobalCache& cache)
+    {
+        std::optional<uint64_t> slot = root->find_global_slot(bytecode.constants[cache.name].to_string());
+        if(!slot)
+        {
+            return false;
+        }
+        cache.slot = *slot;
+        cache.version = root->globals_version;
+        return true;
+    }
+
+    static std::string private_access_error(const char* kind, const String* name)
+    {
+        std::stringstream ss;
+        ss << "(Runtime Error): Cannot access the private " << kind << " '" << name->text << "' outside of the class it is defined in";
+        return ss.str();
+    }
+
+    std::optional<std::string> VirtualMachine::resolve_get(Object* obj, String* name, Bytecode::PropertyCache::Entry& entry)
+    {
+        entry.name = name;
+        uint32_t index = obj->shape->find(name);
+        if(index != Shape::NO_SLOT)
+        {
+            const Shape::Slot& slot = obj->shape->slots[index];
+            if(slot.is_private && current_class_context != slot.class_context)
+            {
+                return private_access_error("property", name);
+            }
+            entry.kind = Bytecode::PropertyCache::Kind::SLOT;
+            entry.slot = index;
+            entry.shape_id = obj->shape->id;
+            entry.class_context = slot.is_private ? slot.class_context : 0;
+            return {};
+        }
+
+        ClassType::Member* member = obj->type->find_member(name);
+        if(member != nullptr && member->get != nullptr)
+        {
+            const char* kind = member->get_is_getter ? "getter" : "method";
+            if(member->get->is_private && current_class_context != member->get->class_context)
+            {
+                return private_access_error(kind, name);
+            }
+            entry.kind = member->get_is_getter ? Bytecode::PropertyCache::Kind::GETTER : Bytecode::PropertyCache::Kind::METHOD;
+            entry.member = &member->get->val;
+            entry.shape_id = obj->shape->id;
+            entry.class_context = member->get->is_private ? member->get->class_context : 0;
+            return {};
+        }
+
+        std::stringstream ss;
+        ss << "(Runtime Error): '" << name->text << "' does not exist in object of type '" << obj->type->name << "'";
+        return ss.str();
+    }
+
+    std::optional<std::string> VirtualMachine::resolve_set(Object* obj, String* name, Bytecode::PropertyCache::Entry& entry)
+    {
+        entry.name = name;
+        uint32_t index = obj->shape->find(name);
+        if(index != Shape::NO_SLOT)
+        {
+            const Shape::Slot& slot = obj->shape->slots[index];
+            if(slot.is_private && current_class_context != slot.class_context)
+            {
+                return private_access_error("property", name);
+            }
+            entry.kind = Bytecode::PropertyCache::Kind::SLOT;
+            entry.slot = index;
+            entry.shape_id = obj->shape->id;
+            entry.class_context = slot.is_private ? slot.class_context : 0;
+            return {};
+        }
+
+        ClassType::Member* member = obj->type->find_member(name);
+        if(member != nullptr && member->set != nullptr)
+        {
+            const char* kind = member->set_is_setter ? "setter" : "method";
+            if(member->set->is_private && current_class_context != member->set->class_context)
+            {
+                return private_access_error(kind, name);
+            }
+            if(!member->set_is_setter)
+            {
+                std::stringstream ss;
+                ss << "(Runtime Error): Cannot set the value of '" << name->text << "' as it is defined as a method'";
+                return ss.str();
+            }
+            entry.kind = Bytecode::PropertyCache::Kind::SETTER;
+            entry.member = &member->set->val;
+            entry.shape_id = obj->shape->id;
+            entry.class_context = member->set->is_private ? member->set->class_context : 0;
+            return {};
+        }
+
+        std::stringstream ss;
+        ss << "(Runtime Error): '" << name->text << "' does not exist in object of type '" << obj->type->name << "'";
+        return ss.str();
+    }
+
+    std::optional<std::string> VirtualMachine::run_frame(const Bytecode& bytecode, Data::Impl* data, uint64_t frame_base, bool is_function)
     {
-        Data scope;
-        scope.get_impl()->parent = data;
-        for(int i = -arg_count; i < 0; i++)
+        // Arguments are already in place as the first slots, the remaining locals start out null.
+        if(data->stack.size() < frame_base + bytecode.slot_count)
+        {
+            data->stack.resize(frame_base + bytecode.slot_count);
+        }
+
+        if(root == nullptr)
+        {
+            root = data->get_root();
+        }
+
+        if(root->call_depth >= root->max_call_depth)
+        {
+            return stack_overflow_error(bytecode);
+        }
+        frames.push_back({&bytecode, data, frame_base, nullptr, 0, root->scopes_in_use, current_class_context, is_function});
+        root->call_depth++;
+        size_t entry_depth = frames.size();
+
+        std::optional<std::string> error;
+        try
         {
-            Value val = data->index_stack(i);
-            UNPACK_REF(val);
-            scope.get_impl()->stack.emplace_back(val);
-            data->stack.erase(data->stack.begin() + (data->stack.size() + i));
+            error = run_bytecode(entry_depth);
         }
+        catch(const SourDoError& err)
+        {
+            // Allocations throw once the heap is out of memory.
+            error = frames.back().bytecode->file_name + "(Runtime Error): " + err.what();
+        }
+
+        // After an error, the frames of the calls it happened in are still there.
+        root->call_depth -= frames.size() - entry_depth + 1;
+        frames.resize(entry_depth - 1);
+        return error;
+    }
+
+    std::optional<std::string> VirtualMachine::stack_overflow_error(const Bytecode& bytecode)
+    {
+        std::stringstream ss;
+        ss << bytecode.file_name << "(Runtime Error): Stack overflow, calls are nested deeper than " << root->max_call_depth << " levels";
+        return ss.str();
+    }
 
-        Value func = data->index_stack(-1);
+    std::optional<std::string> VirtualMachine::call_function(const Bytecode& bytecode, Data::Impl* data, uint64_t arg_count, uint64_t return_address)
+    {
+        Value func = data->index_stack(-arg_count - 1);
         UNPACK_REF(func);
-        data->stack.pop_back();
+
+        // The arguments become the bottom of the callee's stack where they are. The function stays below them until the call returns.
+        Data& scope = root->push_scope(data, arg_count);
+        for(uint64_t i = 0; i < arg_count; i++)
+        {
+            UNPACK_REF(scope.get_impl()->stack[i]);
+        }
 
         if(func.get_type() == ValueType::SOURDO_FUNCTION)
         {
@@ -1116,24 +1428,20 @@ namespace sourdo
                 }
                 return ss.str();
             }
-            std::optional<std::string> saved_class_context = current_class_context;
-            current_class_context = func.to_sourdo_function()->class_context;
-            bool saved_state = is_function;
-            is_function = true;
-            uint64_t saved_ipointer = ipointer;
-            ipointer = 0;
-            std::optional<std::string> error = run_bytecode(func.to_sourdo_function()->bytecode, scope.get_impl());
-            if(error)
+            if(root->call_depth >= root->max_call_depth)
             {
-                return error;
+                return stack_overflow_error(bytecode);
             }
-            returning = false;
-            ipointer = saved_ipointer;
-            is_function = saved_state;
-            current_class_context = saved_class_context;
-            data->stack.emplace_back(scope.get_impl()->index_stack(-1));
 
-            GarbageCollector::collect_garbage(scope.get_impl());
+            // The loop in run_bytecode switches to the new frame.
+            SourDoFunction* function = func.to_sourdo_function();
+            Data::Impl* scope_impl = scope.get_impl();
+            if(scope_impl->stack.size() < function->bytecode.slot_count)
+            {
+                scope_impl->stack.resize(function->bytecode.slot_count);
+            }
+            frames.push_back({&function->bytecode, scope_impl, 0, data, return_address, root->scopes_in_use - 1, function->class_context, true});
+            root->call_depth++;
             return {};
         }
         else if(func.get_type() == ValueType::CPP_FUNCTION)
@@ -1141,14 +1449,9 @@ namespace sourdo
             try
             {
                 bool does_return = func.to_cpp_function()(scope);
-                if(does_return)
-                {
-                    data->stack.emplace_back(scope.get_impl()->index_stack(-1));
-                }
-                else
-                {
-                    data->stack.emplace_back(Null());
-                }
+                Value result = does_return ? scope.get_impl()->index_stack(-1) : Value(Null());
+                root->pop_scope();
+                data->stack.back() = result;
                 return {};
             }
             catch(SourDoError err)
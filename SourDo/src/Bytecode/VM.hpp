@@ -12,13 +12,42 @@ namespace sourdo
     class VirtualMachine
     {
     public:
-        std::optional<std::string> run_bytecode(const Bytecode& bytecode, Data::Impl* data);
+        // Runs a function body or main chunk from the start, with its local slots beginning at 'frame_base' in the stack of 'data'.
+        std::optional<std::string> run_frame(const Bytecode& bytecode, Data::Impl* data, uint64_t frame_base, bool is_function = false);
     private:
-        std::optional<std::string> current_class_context;
-        uint64_t ipointer = 0;
-        bool is_function = false;
-        bool returning = false;
+        // A function or main chunk that is running. Blocks inside it share its frame.
+        struct CallFrame
+        {
+            const Bytecode* bytecode;
+            // Holds the local slots, starting at 'frame_base'.
+            Data::Impl* scope;
+            uint64_t frame_base;
+            // The scope the function was called from and the instruction to continue at there. Unused for the frame run_frame starts with.
+            Data::Impl* caller;
+            uint64_t return_address;
+            // Pooled scopes in use before the frame's own scope. Returning leaves every scope above this.
+            size_t scope_depth;
+            uint32_t class_context;
+            bool is_function;
+        };
 
-        std::optional<std::string> call_function(const Bytecode& bytecode, Data::Impl* data, uint64_t arg_count);
+        // Calls and returns push and pop frames here instead of recursing, so script recursion doesn't use the native stack.
+        std::vector<CallFrame> frames;
+        // The outermost scope, which holds the globals.
+        Data::Impl* root = nullptr;
+        // The class context of the running function, 0 outside of classes.
+        uint32_t current_class_context = 0;
+
+        // Runs until the frame at 'entry_depth' returns or halts.
+        std::optional<std::string> run_bytecode(size_t entry_depth);
+        // Fills 'cache' with the slot of its global. Returns false if the global doesn't exist.
+        bool cache_global_slot(const Bytecode& bytecode, Bytecode::GlobalCache& cache);
+        // Finds what reading or writing 'name' on 'obj' refers to and checks that the current class may access it.
+        // The entry gets the id of the shape of 'obj' if it may be cached.
+        std::optional<std::string> resolve_get(Object* obj, String* name, Bytecode::PropertyCache::Entry& entry);
+        std::optional<std::string> resolve_set(Object* obj, String* name, Bytecode::PropertyCache::Entry& entry);
+        // Calls a C++ function right away. A SourDo function gets a new frame, which run_bytecode then switches to.
+        std::optional<std::string> call_function(const Bytecode& bytecode, Data::Impl* data, uint64_t arg_count, uint64_t return_address);
+        std::optional<std::string> stack_overflow_error(const Bytecode& bytecode);
     };
 } // namespace sourdo
@@ -7,19 +7,14 @@ namespace sourdo
 {
     struct SourDoFunction : public GCObject
     {
-        SourDoFunction(uint64_t parameter_count, const std::optional<std::string>& class_context, const Bytecode& bytecode)
-            : parameter_count(parameter_count), class_context(class_context), bytecode(bytecode)
+        SourDoFunction(uint64_t parameter_count, uint32_t class_context, const Bytecode& bytecode)
+            : GCObject(GCType::SOURDO_FUNCTION), parameter_count(parameter_count), class_context(class_context), bytecode(bytecode)
         {
         }
-        
-        virtual ~SourDoFunction() = default;
 
         uint64_t parameter_count;
-        std::optional<std::string> class_context;
+        // The class whose private members the function may access, or 0.
+        uint32_t class_context;
         Bytecode bytecode;
-
-        void on_garbage_collected(Data::Impl* data) final
-        {
-        }
     };
 } // namespace sourdo
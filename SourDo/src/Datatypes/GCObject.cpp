@@ -4,10 +4,30 @@
 
 namespace sourdo
 {
-    void* GCObject::operator new(size_t size)
+    void* GCObject::operator new(size_t size, GarbageCollector& heap)
     {
-        void* object = ::operator new(size);
-        GarbageCollector::add_object((GCObject*)object);
-        return object;
+        return heap.allocate(size);
+    }
+
+    void GCObject::operator delete(void* /*object*/, GarbageCollector& heap)
+    {
+        // Only called when a constructor throws, right after operator new added the object.
+        heap.remove_last_object();
+    }
+
+    void GCObject::operator delete(void* /*object*/)
+    {
+    }
+
+    void* allocate_internals(GarbageCollector& heap, size_t size)
+    {
+        heap.charge(size);
+        return ::operator new(size);
+    }
+
+    void free_internals(GarbageCollector& heap, void* memory, size_t size)
+    {
+        ::operator delete(memory);
+        heap.uncharge(size);
     }
 } // namespace sourdo
@@ -1,19 +1,92 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 #include "SourDo/SourDo.hpp"
 
 namespace sourdo
 {
+    class GarbageCollector;
+
+    // The kind of a heap object. The heap destroys objects through it, so they don't need a vtable.
+    enum class GCType : uint8_t
+    {
+        STRING,
+        SOURDO_FUNCTION,
+        TABLE,
+        CLASS_TYPE,
+        OBJECT,
+        CPP_OBJECT,
+    };
+
     struct GCObject
     {
-        virtual ~GCObject() = default;
-        
-        bool marked = true;
+        explicit GCObject(GCType gc_type)
+            : gc_type(gc_type)
+        {
+        }
+
+        const GCType gc_type;
+        // The flags are separate bytes because the background marker reads 'snapshotted' while the program thread
+        // writes the others. Marks are kept in the page of the object.
+        // Set once the object has survived a collection and moved to the old generation.
+        bool old = false;
+        // Set while the object is in the remembered set of its heap.
+        bool remembered = false;
+        // Set once the object has been traced before its first store of a concurrent marking.
+        bool snapshotted = false;
+
+        // Objects are always created on the heap of a state, with 'new(heap) Type(...)'.
+        static void* operator new(size_t size, GarbageCollector& heap);
+        static void operator delete(void* object, GarbageCollector& heap);
+        // The heap owns the memory of its objects and releases it itself, so this does nothing.
+        static void operator delete(void* object);
+    };
+
+    // Memory owned by heap objects, such as the entries of their containers, counts towards the usage of their heap.
+    void* allocate_internals(GarbageCollector& heap, size_t size);
+    void free_internals(GarbageCollector& heap, void* memory, size_t size);
+
+    // Allocator for the containers of heap objects. Throws SourDoError once the heap would pass its hard limit.
+    template<typename T>
+    struct HeapAllocator
+    {
+        using value_type = T;
+
+        explicit HeapAllocator(GarbageCollector& heap)
+            : heap(&heap)
+        {
+        }
+
+        template<typename U>
+        HeapAllocator(const HeapAllocator<U>& other)
+            : heap(other.heap)
+        {
+        }
+
+        T* allocate(size_t count)
+        {
+            return static_cast<T*>(allocate_internals(*heap, count * sizeof(T)));
+        }
+
+        void deallocate(T* memory, size_t count)
+        {
+            free_internals(*heap, memory, count * sizeof(T));
+        }
+
+        template<typename U>
+        bool operator==(const HeapAllocator<U>& other) const
+        {
+            return heap == other.heap;
+        }
 
-        static void* operator new(size_t size);
+        template<typename U>
+        bool operator!=(const HeapAllocator<U>& other) const
+        {
+            return heap != other.heap;
+        }
 
-        virtual void on_garbage_collected(Data::Impl* data) = 0;
+        GarbageCollector* heap;
     };
 } // namespace sourdo
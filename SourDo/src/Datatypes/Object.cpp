@@ -2,25 +2,131 @@
 
 #include "Value.hpp"
 #include "../SourDoData.hpp"
+#include "../GarbageCollector.hpp"
 #include "Function.hpp"
 
 #include <sstream>
+#include <algorithm>
 
 namespace sourdo
 {
+    Shape* ClassType::transition(Shape* shape, const Shape::Slot& slot)
+    {
+        for(Shape* next : shape->transitions)
+        {
+            const Shape::Slot& changed = next->slots[next->changed_slot];
+            if(changed.name == slot.name && changed.class_context == slot.class_context
+                && changed.is_private == slot.is_private && changed.readonly == slot.readonly)
+            {
+                return next;
+            }
+        }
+
+        shapes.push_back(std::make_unique<Shape>());
+        Shape* next = shapes.back().get();
+        next->slots = shape->slots;
+        next->changed_slot = shape->find(slot.name);
+        if(next->changed_slot == Shape::NO_SLOT)
+        {
+            next->changed_slot = next->slots.size();
+            next->slots.push_back(slot);
+        }
+        else
+        {
+            next->slots[next->changed_slot] = slot;
+        }
+        if(next->slots.size() > Shape::MAX_SEARCHED_SLOTS)
+        {
+            for(uint32_t i = 0; i < next->slots.size(); i++)
+            {
+                next->indices[next->slots[i].name] = i;
+            }
+        }
+        shape->transitions.push_back(next);
+        return next;
+    }
+
+    void ClassType::build_members()
+    {
+        // The nearest class wins, so a name is only filled in the first time it is found.
+        for(ClassType* current_type = this; current_type != nullptr; current_type = current_type->super)
+        {
+            for(auto&[name, getter] : current_type->getters)
+            {
+                Member& member = members[name];
+                if(member.get == nullptr)
+                {
+                    member.get = &getter;
+                    member.get_is_getter = true;
+                }
+            }
+            for(auto&[name, setter] : current_type->setters)
+            {
+                Member& member = members[name];
+                if(member.set == nullptr)
+                {
+                    member.set = &setter;
+                    member.set_is_setter = true;
+                }
+            }
+            for(auto&[name, method] : current_type->methods)
+            {
+                Member& member = members[name];
+                if(member.method == nullptr)
+                {
+                    member.method = &method;
+                }
+                if(member.get == nullptr)
+                {
+                    member.get = &method;
+                }
+                if(member.set == nullptr)
+                {
+                    member.set = &method;
+                }
+            }
+        }
+        for(auto&[name, class_method] : class_methods)
+        {
+            members[name].class_method = &class_method;
+        }
+    }
+
+    void Object::add_property(String* name, const Value& value, uint32_t class_context, bool is_private, bool readonly)
+    {
+        uint32_t index = shape->find(name);
+        // The slot is added before the shape changes, so an allocation that hits the hard limit leaves the object as it was.
+        if(index == Shape::NO_SLOT)
+        {
+            slots.push_back(value);
+            type->slot_count_hint = std::max<uint32_t>(type->slot_count_hint, slots.size());
+        }
+        else
+        {
+            slots[index] = value;
+        }
+
+        if(index == Shape::NO_SLOT || shape->slots[index].class_context != class_context
+            || shape->slots[index].is_private != is_private || shape->slots[index].readonly != readonly)
+        {
+            shape = type->transition(shape, {name, class_context, is_private, readonly});
+        }
+    }
+
     void Object::on_garbage_collected(Data::Impl* data)
     {
-        Value* sym = find_method("__gc");
+        Value* sym = find_method(data->heap->intern_string("__gc"));
         if(sym)
         {
             if(sym->get_type() == ValueType::SOURDO_FUNCTION
                 || sym->get_type() == ValueType::CPP_FUNCTION)
             {
-                Data scope;
-                scope.get_impl()->parent = data;
+                Data::Impl* root = data->get_root();
+                Data& scope = root->push_scope(data);
                 scope.get_impl()->stack.emplace_back(*sym);
                 scope.get_impl()->stack.emplace_back(this);
                 scope.call_function(1, true);
+                root->pop_scope();
             }
         }
     }
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "GCObject.hpp"
+
+#include <string>
+#include <string_view>
+
+namespace sourdo
+{
+    // Strings up to this length are always interned when they are created.
+    constexpr size_t MAX_SHORT_STRING_LENGTH = 40;
+
+    /**
+     * @brief An immutable string that lives on the garbage collected heap.
+     * 
+     * @note Interned strings are unique, so two interned strings are equal only if they are the same object.
+     */
+    struct String : public GCObject
+    {
+        String(const std::string& text, bool interned)
+            : GCObject(GCType::STRING), text(text), hash(std::hash<std::string_view>()(this->text)), interned(interned)
+        {
+        }
+
+        const std::string text;
+        const size_t hash;
+        const bool interned;
+    };
+
+    inline bool strings_equal(const String* first, const String* second)
+    {
+        if(first == second)
+        {
+            return true;
+        }
+        if(first->interned && second->interned)
+        {
+            return false;
+        }
+        return first->hash == second->hash && first->text == second->text;
+    }
+} // namespace sourdo
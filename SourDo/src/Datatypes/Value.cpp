@@ -5,37 +5,188 @@
 
 namespace sourdo
 {
+#ifdef SOURDO_COMPACT_VALUE
     Value::Value()
     {
         type = ValueType::_NULL;
-        value = Null();
+        payload.number = 0;
     }
 
     Value::Value(Null new_value)
     {
         type = ValueType::_NULL;
-        value = new_value;
+        payload.number = 0;
     }
 
     Value::Value(double new_value)
     {
         type = ValueType::NUMBER;
-        value = new_value;
+        payload.number = new_value;
     }
 
     Value::Value(bool new_value)
     {
         type = ValueType::BOOL;
-        value = new_value;
+        payload.boolean = new_value;
     }
     
-    Value::Value(const std::string& new_value)
+    Value::Value(String* new_value)
     {
         type = ValueType::STRING;
+        payload.string = new_value;
+    }
+
+    Value::Value(SourDoFunction* new_value)
+    {
+        type = ValueType::SOURDO_FUNCTION;
+        payload.sourdo_function = new_value;
+    }
+
+    Value::Value(const CppFunction& new_value)
+    {
+        type = ValueType::CPP_FUNCTION;
+        payload.cpp_function = new_value;
+    }
+
+    Value::Value(Value* new_value)
+    {
+        type = ValueType::VALUE_REF;
+        payload.value_ref = new_value;
+    }
+
+    Value::Value(Object* new_value)
+    {
+        type = ValueType::OBJECT;
+        payload.object = new_value;
+    }
+
+    Value::Value(Table* new_value)
+    {
+        type = ValueType::TABLE;
+        payload.table = new_value;
+    }
+
+    Value::Value(ClassType* new_value)
+    {
+        type = ValueType::CLASS_TYPE;
+        payload.class_type = new_value;
+    }
+    
+    Value::Value(CppObject* new_value)
+    {
+        type = ValueType::CPP_OBJECT;
+        payload.cpp_object = new_value;
+    }
+
+    Value& Value::operator=(Null new_value)
+    {
+        return *this = Value(new_value);
+    }
+    
+    Value& Value::operator=(double new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(bool new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(String* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(SourDoFunction* new_value)
+    {
+        return *this = Value(new_value);
+    }
+    
+    Value& Value::operator=(const CppFunction& new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(Value* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(Object* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(Table* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(ClassType* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    Value& Value::operator=(CppObject* new_value)
+    {
+        return *this = Value(new_value);
+    }
+
+    bool Value::operator==(const Value& other) const
+    {
+        if(type != other.type)
+        {
+            return false;
+        }
+
+        switch(type)
+        {
+            case ValueType::_NULL:
+                return true;
+            case ValueType::NUMBER:
+                return payload.number == other.payload.number;
+            case ValueType::BOOL:
+                return payload.boolean == other.payload.boolean;
+            case ValueType::STRING:
+                return strings_equal(payload.string, other.payload.string);
+            case ValueType::CPP_FUNCTION:
+                return payload.cpp_function == other.payload.cpp_function;
+            default:
+                return payload.object == other.payload.object;
+        }
+    }
+
+    bool Value::operator!=(const Value& other) const
+    {
+        return !(*this == other);
+    }
+#else
+    Value::Value()
+    {
+        type = ValueType::_NULL;
+        value = Null();
+    }
+
+    Value::Value(Null new_value)
+    {
+        type = ValueType::_NULL;
         value = new_value;
     }
 
-    Value::Value(const char* new_value)
+    Value::Value(double new_value)
+    {
+        type = ValueType::NUMBER;
+        value = new_value;
+    }
+
+    Value::Value(bool new_value)
+    {
+        type = ValueType::BOOL;
+        value = new_value;
+    }
+    
+    Value::Value(String* new_value)
     {
         type = ValueType::STRING;
         value = new_value;
@@ -136,14 +287,7 @@ namespace sourdo
         return *this;
     }
 
-    Value& Value::operator=(const std::string& new_value)
-    {
-        type = ValueType::STRING;
-        value = new_value;
-        return *this;
-    }
-
-    Value& Value::operator=(const char* new_value)
+    Value& Value::operator=(String* new_value)
     {
         type = ValueType::STRING;
         value = new_value;
@@ -201,14 +345,20 @@ namespace sourdo
 
     bool Value::operator==(const Value& other) const
     {
+        if(type == ValueType::STRING && other.type == ValueType::STRING)
+        {
+            return strings_equal(to_string(), other.to_string());
+        }
         return value == other.value;
     }
 
     bool Value::operator!=(const Value& other) const
     {
-        return value != other.value;
+        return !(*this == other);
     }
 
+#endif
+
     ValueType Value::get_type() const
     {
         return type;
@@ -230,7 +380,7 @@ namespace sourdo
                 os << val.to_bool();
                 break;
             case ValueType::STRING: 
-                os << "\"" << val.to_string() << "\"";
+                os << "\"" << val.to_string()->text << "\"";
                 break;
             case ValueType::SOURDO_FUNCTION: 
                 os << "[SourdoFunc: " << val.to_sourdo_function() << "]";
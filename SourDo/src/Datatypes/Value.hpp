@@ -2,11 +2,15 @@
 
 #include "SourDo/SourDo.hpp"
 #include "GCObject.hpp"
+#include "String.hpp"
 
 #include <vector>
 #include <variant>
 #include <string>
 #include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <type_traits>
 
 namespace sourdo 
 {
@@ -38,8 +42,7 @@ namespace sourdo
         Value(Null new_value);
         Value(double new_value);
         Value(bool new_value);
-        Value(const std::string& new_value);
-        Value(const char* new_value);
+        Value(String* new_value);
         Value(SourDoFunction* new_value);
         Value(const CppFunction& new_value);
         Value(Value* new_value);
@@ -48,17 +51,24 @@ namespace sourdo
         Value(ClassType* new_value);
         Value(CppObject* new_value);
         
+#ifdef SOURDO_COMPACT_VALUE
+        Value(const Value& new_value) = default;
+        Value(Value&& new_value) = default;
+
+        Value& operator=(const Value& new_value) = default;
+        Value& operator=(Value&& new_value) = default;
+#else
         Value(const Value& new_value);
         Value(Value&& new_value);
 
         Value& operator=(const Value& new_value);
         Value& operator=(Value&& new_value);
+#endif
 
         Value& operator=(Null new_value);
         Value& operator=(double new_value);
         Value& operator=(bool new_value);
-        Value& operator=(const std::string& new_value);
-        Value& operator=(const char* new_value);
+        Value& operator=(String* new_value);
         Value& operator=(SourDoFunction* new_value);
         Value& operator=(const CppFunction& new_value);
         Value& operator=(Value* new_value);
@@ -72,6 +82,57 @@ namespace sourdo
 
         ValueType get_type() const;
 
+#ifdef SOURDO_COMPACT_VALUE
+        double to_number() const
+        { 
+            return payload.number;
+        }
+        
+        bool to_bool() const
+        {
+            return payload.boolean; 
+        }
+
+        String* to_string() const
+        {
+            return payload.string; 
+        }
+
+        SourDoFunction* to_sourdo_function() const
+        {
+            return payload.sourdo_function;
+        }
+
+        CppFunction to_cpp_function() const
+        {
+            return payload.cpp_function;
+        }
+
+        Value* to_value_ref() const
+        {
+            return payload.value_ref;
+        }
+
+        Table* to_table() const
+        {
+            return payload.table;
+        }
+
+        ClassType* to_class() const
+        {
+            return payload.class_type;
+        }
+
+        Object* to_object() const
+        {
+            return payload.object;
+        }
+
+        CppObject* to_cpp_object() const
+        {
+            return payload.cpp_object;
+        }
+#else
         double to_number() const
         { 
             return std::get<double>(value);
@@ -82,9 +143,9 @@ namespace sourdo
             return std::get<bool>(value); 
         }
 
-        std::string to_string() const
+        String* to_string() const
         {
-            return std::get<std::string>(value); 
+            return std::get<String*>(value); 
         }
 
         SourDoFunction* to_sourdo_function() const
@@ -121,16 +182,32 @@ namespace sourdo
         {
             return std::get<CppObject*>(value);
         }
+#endif
     private:
         friend struct std::hash<Value>;
         friend std::ostream& operator<<(std::ostream& os, const Value& val);
         ValueType type;
 
+#ifdef SOURDO_COMPACT_VALUE
+        union Payload
+        {
+            double number;
+            bool boolean;
+            String* string;
+            SourDoFunction* sourdo_function;
+            CppFunction cpp_function;
+            Value* value_ref;
+            Object* object;
+            Table* table;
+            ClassType* class_type;
+            CppObject* cpp_object;
+        } payload;
+#else
         std::variant<
                 Null,
                 double, 
                 bool,
-                std::string, 
+                String*, 
                 SourDoFunction*, 
                 CppFunction,
                 Value*,
@@ -139,8 +216,14 @@ namespace sourdo
                 ClassType*,
                 CppObject*
             > value;
+#endif
     };
 
+#ifdef SOURDO_COMPACT_VALUE
+    static_assert(sizeof(Value) <= 16, "Compact values should fit in a tag and an 8 byte payload");
+    static_assert(std::is_trivially_copyable_v<Value>, "Compact values should be copied without any bookkeeping");
+#endif
+
     std::ostream& operator<<(std::ostream& os, const Value& val);
 } // namespace SourDo
 
@@ -160,11 +243,32 @@ namespace std
     {
         std::size_t operator()(const sourdo::Value& k) const
         {
+            // Strings use the hash that was computed when they were created.
+            if(k.type == sourdo::ValueType::STRING)
+            {
+                return k.to_string()->hash;
+            }
+#ifdef SOURDO_COMPACT_VALUE
+            switch(k.type)
+            {
+                case sourdo::ValueType::_NULL:
+                    return std::hash<nullptr_t>()(nullptr);
+                case sourdo::ValueType::NUMBER:
+                    return std::hash<double>()(k.payload.number);
+                case sourdo::ValueType::BOOL:
+                    return std::hash<bool>()(k.payload.boolean);
+                case sourdo::ValueType::CPP_FUNCTION:
+                    return std::hash<sourdo::CppFunction>()(k.payload.cpp_function);
+                default:
+                    // Every other type is a pointer that is compared by identity.
+                    return std::hash<void*>()(k.payload.object);
+            }
+#else
             return std::hash<std::variant<
                     sourdo::Null, 
                     double, 
                     bool, 
-                    std::string, 
+                    sourdo::String*, 
                     sourdo::SourDoFunction*, 
                     sourdo::CppFunction,
                     sourdo::Value*,
@@ -173,6 +277,7 @@ namespace std
                     sourdo::ClassType*,
                     sourdo::CppObject*
                 >>()(k.value);
+#endif
         }
     };
 } // namespace std
@@ -181,21 +286,71 @@ namespace sourdo
 {
     struct Table : public GCObject
     {
-        Table() = default;
-        
-        Table(const std::unordered_map<Value, Value>& keys)
-            : keys(keys)
+        using Entries = std::unordered_map<Value, Value, std::hash<Value>, std::equal_to<Value>, HeapAllocator<std::pair<const Value, Value>>>;
+
+        // The entries are charged to 'heap', which must be the heap the table is created on.
+        explicit Table(GarbageCollector& heap)
+            : GCObject(GCType::TABLE), keys(HeapAllocator<std::pair<const Value, Value>>(heap))
         {
         }
-        
-        virtual ~Table() = default;
 
-        std::unordered_map<Value, Value> keys;
+        // Declared first so that they fit next to the header.
         bool readonly = false;
+        // Set with Data::set_table_weakness(). Weak keys and values don't keep their objects alive.
+        bool weak_keys = false;
+        bool weak_values = false;
+        Entries keys;
+    };
 
-        void on_garbage_collected(Data::Impl* data) final
+    /**
+     * @brief The layout of the properties of an object. The objects of a class that got the same properties in the same
+     * order share a shape, and keep the values of their properties in the order of its slots. Adding a property, or
+     * redefining one, moves an object to the shape that its class made for that change.
+     */
+    struct Shape
+    {
+        struct Slot
         {
+            String* name;
+            // The type id of the class that defined the property, see GarbageCollector::type_id.
+            uint32_t class_context;
+            bool is_private;
+            bool readonly;
+        };
+
+        static constexpr uint32_t NO_SLOT = UINT32_MAX;
+        // Shapes with more slots than this index them by name instead of searching them.
+        static constexpr size_t MAX_SEARCHED_SLOTS = 8;
+
+        // Returns the index of the slot named 'name', or NO_SLOT.
+        uint32_t find(String* name) const
+        {
+            if(slots.size() > MAX_SEARCHED_SLOTS)
+            {
+                auto it = indices.find(name);
+                return it == indices.end() ? NO_SLOT : it->second;
+            }
+            for(uint32_t i = 0; i < slots.size(); i++)
+            {
+                if(slots[i].name == name)
+                {
+                    return i;
+                }
+            }
+            return NO_SLOT;
         }
+
+        // Identifies the shape in inline caches. Ids are unique across states and never reused, so a cache
+        // entry never matches a shape that was created after the one it was filled for was freed.
+        const uint64_t id = ++id_counter;
+        static inline std::atomic<uint64_t> id_counter = 0;
+
+        std::vector<Slot> slots;
+        std::unordered_map<String*, uint32_t> indices;
+        // The slot this shape added or changed. Unused for the empty shape.
+        uint32_t changed_slot = NO_SLOT;
+        // The shapes made from this one so far.
+        std::vector<Shape*> transitions;
     };
 
     struct ClassType : public GCObject
@@ -204,102 +359,145 @@ namespace sourdo
         {
             Property() = default;
 
-            Property(const Value& val, const std::string& class_context, bool is_private, bool readonly)
+            Property(const Value& val, uint32_t class_context, bool is_private, bool readonly)
                 : val(val), class_context(class_context), is_private(is_private), readonly(readonly)
             {
             }
 
             Value val;
-            std::string class_context;
+            uint32_t class_context = 0;
             bool is_private = false;
             bool readonly = false;
         };
 
-        ClassType(const std::string& name, ClassType* super)
-            : name(name), super(super)
+        ClassType(const std::string& name, uint32_t id, ClassType* super)
+            : GCObject(GCType::CLASS_TYPE), super(super), name(name), id(id)
         {
+            if(super != nullptr)
+            {
+                ancestors = super->ancestors;
+            }
+            ancestors.push_back(id);
+            shapes.push_back(std::make_unique<Shape>());
         }
 
-        virtual ~ClassType() = default;
+        // Returns the shape objects with 'shape' get once 'slot' is added to it, or replaces its slot of the same name.
+        Shape* transition(Shape* shape, const Shape::Slot& slot);
+        // Fills 'members' once the class is complete.
+        void build_members();
+
         ClassType* super = nullptr;
 
         SourDoFunction* initializer = nullptr;
-        std::unordered_map<std::string, Property> methods;
-        std::unordered_map<std::string, Property> setters;
-        std::unordered_map<std::string, Property> getters;
+        // Member names are interned strings, so they are looked up by their address.
+        std::unordered_map<String*, Property> methods;
+        std::unordered_map<String*, Property> setters;
+        std::unordered_map<String*, Property> getters;
+
+        std::unordered_map<String*, Property> class_methods;
+
+        // What a name refers to on the objects of this class and on the class itself, inherited members included.
+        struct Member
+        {
+            // A read finds the getter or the method of the nearest class that defines either, getters first.
+            Property* get = nullptr;
+            bool get_is_getter = false;
+            // A write finds a setter the same way, or a method, which can't be assigned to.
+            Property* set = nullptr;
+            bool set_is_setter = false;
+            Property* method = nullptr;
+            // Class methods aren't inherited.
+            Property* class_method = nullptr;
+        };
+        // Built when the class is complete, so members are found with one lookup however deep the hierarchy is.
+        // Points into the maps above and into those of the base classes, which don't change once they are complete.
+        std::unordered_map<String*, Member> members;
 
-        std::unordered_map<std::string, Property> class_methods;
+        Member* find_member(String* name)
+        {
+            auto it = members.find(name);
+            return it == members.end() ? nullptr : &it->second;
+        }
         
         std::string name;
+        // The functions of the class run with it as their class context, and isa checks look for it.
+        uint32_t id;
+        // The ids of the base classes from the root of the hierarchy down, followed by the id of this class,
+        // so the class with the id ancestors[depth] is a base of this one if it has 'depth' base classes.
+        std::vector<uint32_t> ancestors;
         bool complete = false;
 
-        void on_garbage_collected(Data::Impl* data) override {}
+        // Every shape the objects of this class have had. The first one is empty, new objects start with it.
+        std::vector<std::unique_ptr<Shape>> shapes;
+        // The most properties an object of this class has had. New objects make room for that many up front.
+        uint32_t slot_count_hint = 0;
     };
 
     struct Object : public GCObject
     {
-        Object() = default;
-
-        Object(ClassType* type)
-            : type(type)
+        Object(GarbageCollector& heap, ClassType* type)
+            : Object(heap, type, GCType::OBJECT)
         {
         }
 
-        virtual ~Object() = default;
         ClassType* type = nullptr;
+        // Null for objects without a class, which have no properties.
+        Shape* shape = nullptr;
+        // The values of the properties, in the order of the slots of the shape.
+        std::vector<Value, HeapAllocator<Value>> slots;
+
+        // Returns the property named 'name', or nullptr if the object doesn't have it.
+        Value* find_property(String* name)
+        {
+            uint32_t index = shape == nullptr ? Shape::NO_SLOT : shape->find(name);
+            return index == Shape::NO_SLOT ? nullptr : &slots[index];
+        }
 
-        std::unordered_map<std::string, ClassType::Property> props;
+        // Adds the property, or redefines the one with the same name. The object must have a class.
+        void add_property(String* name, const Value& value, uint32_t class_context, bool is_private, bool readonly);
 
-        Value* find_method(std::string name)
+        Value* find_method(String* name)
         {
-            ClassType* current_type = type;
-            while(current_type != nullptr)
-            {
-                if(current_type->methods.find(name) != current_type->methods.end())
-                {
-                    return &current_type->methods[name].val;
-                }
-                current_type = current_type->super;
-            }
-            return nullptr;
+            ClassType::Member* member = type == nullptr ? nullptr : type->find_member(name);
+            return member == nullptr || member->method == nullptr ? nullptr : &member->method->val;
         }
 
-        ClassType::Property* find_symbol(std::string name)
+        // Calls the __gc method of the object's class, if it has one.
+        void on_garbage_collected(Data::Impl* data);
+    protected:
+        // The values of the properties are charged to 'heap', which must be the heap the object is created on.
+        Object(GarbageCollector& heap, ClassType* type, GCType gc_type)
+            : GCObject(gc_type), type(type), slots(HeapAllocator<Value>(heap))
         {
-            if(props.find(name) != props.end())
+            if(type != nullptr)
             {
-                return &props[name];
+                shape = type->shapes.front().get();
+                slots.reserve(type->slot_count_hint);
             }
-            ClassType* current_type = type;
-            while(current_type != nullptr)
-            {
-                if(current_type->methods.find(name) != current_type->methods.end())
-                {
-                    return &current_type->methods[name];
-                }
-                current_type = current_type->super;
-            }
-            return nullptr;
         }
-
-        void on_garbage_collected(Data::Impl* data) override;
     };
 
     struct CppObject : public Object
     {
-        CppObject(ClassType* type, size_t size)
-            : Object(type), block(new uint8_t[size])
+        // The block is charged to 'heap' like the rest of the object.
+        CppObject(GarbageCollector& heap, ClassType* type, size_t size, CppObjectFinalizer finalizer)
+            : Object(heap, type, GCType::CPP_OBJECT), heap(heap), size(size),
+              block(static_cast<uint8_t*>(allocate_internals(heap, size))), finalizer(finalizer)
         {
         }
 
-        void on_garbage_collected(Data::Impl* data) final
+        ~CppObject()
         {
-            Object::on_garbage_collected(data);
-            delete[] block;
+            free_internals(heap, block, size);
         }
 
         ClassType* type = nullptr;
+        GarbageCollector& heap;
+        size_t size;
         uint8_t* block;
+        CppObjectFinalizer finalizer;
+        // Set once the object is garbage and waits in the finalizer queue of its heap.
+        bool finalizer_queued = false;
     };
 
 } // namespace SourDo
\ No newline at end of file
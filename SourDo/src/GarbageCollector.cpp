@@ -1,150 +1,1276 @@
 #include "GarbageCollector.hpp"
+#include "GlobalData.hpp"
 
 #include <iostream>
-
-#include "GlobalData.hpp"
-#include "Datatypes/Function.hpp"
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 
 
 namespace sourdo
 {
-    std::vector<GCObject*> GarbageCollector::objects;
+    GarbageCollector::GarbageCollector()
+    {
+        // Id 0 stands for no class.
+        class_depths.push_back(NO_CLASS_DEPTH);
+        for(const char* name : builtin_type_names)
+        {
+            type_id(name);
+        }
+    }
+
+    GarbageCollector::~GarbageCollector()
+    {
+        if(marker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(marker_mutex);
+                stop_marker = true;
+            }
+            marker_wake.notify_one();
+            marker.join();
+        }
+
+        for(Page* page : pages)
+        {
+            for(size_t offset = FIRST_SLOT_OFFSET; offset < page->unused_offset; offset += page->slot_size)
+            {
+                size_t granule = offset / GRANULE;
+                if(!((page->live_bits[granule / 64] >> (granule % 64)) & 1))
+                {
+                    continue;
+                }
+
+                // Finalizers that haven't run yet run now, so that every one of them runs once.
+                GCObject* object = reinterpret_cast<GCObject*>(reinterpret_cast<uint8_t*>(page) + offset);
+                if(object->gc_type == GCType::CPP_OBJECT && static_cast<CppObject*>(object)->finalizer != nullptr)
+                {
+                    static_cast<CppObject*>(object)->finalizer(static_cast<CppObject*>(object)->block);
+                }
+                destroy_object(object);
+            }
+            ::operator delete(page, std::align_val_t(PAGE_SIZE));
+        }
+        for(Page* page : spare_pages)
+        {
+            ::operator delete(page, std::align_val_t(PAGE_SIZE));
+        }
+    }
+
+    void* GarbageCollector::allocate(size_t size)
+    {
+        // The step runs first, so that the sweep never sees the slot before the object is constructed in it.
+        if(phase != Phase::IDLE && step_size != 0 && !concurrent_cycle)
+        {
+            step_debt += size;
+            if(step_debt >= step_size)
+            {
+                auto start = std::chrono::steady_clock::now();
+                step_debt = 0;
+                step(work_per_step);
+                record_pause(start);
+            }
+        }
+
+        size_t size_class = size > SIZE_CLASSES.back() ? LARGE_OBJECTS : size_class_of(size);
+        size_t slot_size = size_class == LARGE_OBJECTS ? (size + GRANULE - 1) / GRANULE * GRANULE : SIZE_CLASSES[size_class];
+        if(bytes_allocated + slot_size > hard_limit)
+        {
+            out_of_memory(slot_size);
+        }
+
+        Page* page;
+        if(size_class == LARGE_OBJECTS)
+        {
+            page = new_page(LARGE_OBJECTS, slot_size);
+        }
+        else
+        {
+            page = size_classes[size_class].current;
+            if(page == nullptr || !has_free_slot(page))
+            {
+                page = next_page(size_class);
+                size_classes[size_class].current = page;
+            }
+        }
+
+        GCObject* object = take_slot(page);
+        young_objects.push_back(object);
+        bytes_allocated += page->slot_size;
+        young_bytes += page->slot_size;
+
+        return object;
+    }
+
+    void GarbageCollector::remove_last_object()
+    {
+        GCObject* object = young_objects.back();
+        young_objects.pop_back();
+        bytes_allocated -= page_of(object)->slot_size;
+        young_bytes -= page_of(object)->slot_size;
+        release_slot(object);
+    }
+
+    void GarbageCollector::charge(size_t size)
+    {
+        if(bytes_allocated + size > hard_limit)
+        {
+            out_of_memory(size);
+        }
+        bytes_allocated += size;
+    }
+
+    void GarbageCollector::out_of_memory(size_t size)
+    {
+        // The garbage is freed at the next safe point, which may make room again.
+        soft_trigger = 0;
+        std::stringstream ss;
+        ss << "Out of memory, allocating " << size << " more bytes would take the heap past its limit of " << hard_limit << " bytes";
+        throw SourDoError(ss.str());
+    }
+
+    void GarbageCollector::set_memory_limits(size_t soft_limit, size_t hard_limit)
+    {
+        this->soft_limit = soft_limit;
+        this->hard_limit = hard_limit;
+        soft_trigger = soft_limit;
+    }
+
+    void GarbageCollector::update_soft_trigger()
+    {
+        if(bytes_allocated < soft_limit)
+        {
+            soft_trigger = soft_limit;
+            return;
+        }
+        // Collect again once the heap has grown halfway to the hard limit, or as much as it would before a normal collection.
+        size_t headroom = hard_limit > bytes_allocated ? (hard_limit - bytes_allocated) / 2 : 0;
+        headroom = std::min(headroom, std::max(bytes_allocated, minimum_threshold));
+        soft_trigger = headroom == 0 ? SIZE_MAX : bytes_allocated + headroom;
+    }
 
-    void GarbageCollector::add_object(GCObject* object)
+    size_t GarbageCollector::size_class_of(size_t size)
     {
-        objects.emplace_back(object);
+        if(size <= 256)
+        {
+            return size == 0 ? 0 : (size - 1) / 16;
+        }
+        size_t size_class = 16;
+        while(SIZE_CLASSES[size_class] < size)
+        {
+            size_class++;
+        }
+        return size_class;
+    }
+
+    bool GarbageCollector::has_free_slot(const Page* page)
+    {
+        return page->free_slots != nullptr || page->unused_offset + page->slot_size <= PAGE_SIZE;
+    }
+
+    GCObject* GarbageCollector::take_slot(Page* page)
+    {
+        void* slot;
+        if(page->free_slots != nullptr)
+        {
+            slot = page->free_slots;
+            page->free_slots = *static_cast<void**>(slot);
+        }
+        else
+        {
+            slot = reinterpret_cast<uint8_t*>(page) + page->unused_offset;
+            page->unused_offset += page->slot_size;
+        }
+
+        GCObject* object = static_cast<GCObject*>(slot);
+        size_t granule = granule_of(object);
+        page->live_bits[granule / 64] |= uint64_t(1) << (granule % 64);
+        page->live_objects++;
+        return object;
+    }
+
+    GarbageCollector::Page* GarbageCollector::next_page(size_t size_class)
+    {
+        SizeClass& sizes = size_classes[size_class];
+        while(true)
+        {
+            while(!sizes.available.empty())
+            {
+                Page* page = sizes.available.back();
+                sizes.available.pop_back();
+                page->available = false;
+                if(has_free_slot(page))
+                {
+                    return page;
+                }
+            }
+            if(sizes.unswept.empty())
+            {
+                break;
+            }
+
+            // Rather than growing the heap while a sweep is still going, sweep a page of this size class now.
+            Page* page = sizes.unswept.back();
+            sizes.unswept.pop_back();
+            unswept_pages--;
+            sweep_page(page);
+        }
+        return new_page(size_class, SIZE_CLASSES[size_class]);
+    }
+
+    GarbageCollector::Page* GarbageCollector::new_page(size_t size_class, size_t slot_size)
+    {
+        void* memory;
+        if(size_class != LARGE_OBJECTS && !spare_pages.empty())
+        {
+            memory = spare_pages.back();
+            spare_pages.pop_back();
+        }
+        else
+        {
+            memory = ::operator new(std::max(PAGE_SIZE, FIRST_SLOT_OFFSET + slot_size), std::align_val_t(PAGE_SIZE));
+        }
+
+        Page* page = new(memory) Page();
+        page->size_class = size_class;
+        page->slot_size = slot_size;
+        page->unused_offset = FIRST_SLOT_OFFSET;
+        pages.push_back(page);
+        return page;
+    }
+
+    void GarbageCollector::release_slot(GCObject* object)
+    {
+        Page* page = page_of(object);
+        size_t granule = granule_of(object);
+        page->live_bits[granule / 64] &= ~(uint64_t(1) << (granule % 64));
+        page->live_objects--;
+        if(page->size_class == LARGE_OBJECTS)
+        {
+            return;
+        }
+
+        *reinterpret_cast<void**>(object) = page->free_slots;
+        page->free_slots = object;
+        SizeClass& sizes = size_classes[page->size_class];
+        if(!page->available && page != sizes.current)
+        {
+            page->available = true;
+            sizes.available.push_back(page);
+        }
+    }
+
+    void GarbageCollector::destroy_object(GCObject* object)
+    {
+        switch(object->gc_type)
+        {
+            case GCType::STRING:
+                static_cast<String*>(object)->~String();
+                break;
+            case GCType::SOURDO_FUNCTION:
+                static_cast<SourDoFunction*>(object)->~SourDoFunction();
+                break;
+            case GCType::TABLE:
+                static_cast<Table*>(object)->~Table();
+                break;
+            case GCType::CLASS_TYPE:
+                static_cast<ClassType*>(object)->~ClassType();
+                break;
+            case GCType::OBJECT:
+                static_cast<Object*>(object)->~Object();
+                break;
+            case GCType::CPP_OBJECT:
+                static_cast<CppObject*>(object)->~CppObject();
+                break;
+        }
+    }
+
+    void GarbageCollector::free_object(GCObject* object)
+    {
+        if(object->gc_type == GCType::STRING)
+        {
+            uncharge(string_internals(static_cast<String*>(object)->text.size()));
+        }
+        destroy_object(object);
+        release_slot(object);
+    }
+
+    GCRef GarbageCollector::create_ref(const Value& value, bool weak)
+    {
+        uint32_t slot = free_references;
+        if(slot == NO_REFERENCE)
+        {
+            slot = references.size();
+            references.emplace_back();
+        }
+        else
+        {
+            free_references = references[slot].next_free;
+        }
+
+        Reference& reference = references[slot];
+        reference.value = value;
+        reference.in_use = true;
+        reference.weak = weak;
+        young_references.push_back(slot);
+        return (GCRef(reference.generation) << 32) | slot;
+    }
+
+    void GarbageCollector::remove_ref(GCRef ref)
+    {
+        if(find_ref(ref) == nullptr)
+        {
+            return;
+        }
+
+        uint32_t slot = uint32_t(ref);
+        Reference& reference = references[slot];
+        reference.value = Null();
+        reference.in_use = false;
+        // Kept below 2^31 so that refs stay positive.
+        reference.generation = (reference.generation + 1) & INT32_MAX;
+        reference.next_free = free_references;
+        free_references = slot;
+    }
+
+    const Value* GarbageCollector::find_ref(GCRef ref) const
+    {
+        if(ref < 0)
+        {
+            return nullptr;
+        }
+        uint32_t slot = uint32_t(ref);
+        if(slot >= references.size() || !references[slot].in_use || references[slot].generation != uint32_t(ref >> 32))
+        {
+            return nullptr;
+        }
+        return &references[slot].value;
+    }
+
+    void GarbageCollector::set_weakness(Table* table, bool weak_keys, bool weak_values)
+    {
+        // The background thread reads the flags while it traces the table.
+        std::unique_lock<std::mutex> lock;
+        if(concurrent_cycle)
+        {
+            lock = pause_marker();
+        }
+
+        if(!table->weak_keys && !table->weak_values && (weak_keys || weak_values))
+        {
+            weak_tables.push_back(table);
+        }
+        // Entries that were skipped because they were weak have to be traced if the table was already.
+        bool stronger = (table->weak_keys && !weak_keys) || (table->weak_values && !weak_values);
+        table->weak_keys = weak_keys;
+        table->weak_values = weak_values;
+        if(stronger && phase == Phase::MARKING && is_marked(table))
+        {
+            gray_stack.push_back(table);
+        }
+        if(concurrent_cycle)
+        {
+            wake_marker();
+        }
+    }
+
+    bool GarbageCollector::queue_finalizer(GCObject* object)
+    {
+        if(object->gc_type != GCType::CPP_OBJECT || static_cast<CppObject*>(object)->finalizer == nullptr)
+        {
+            return false;
+        }
+
+        CppObject* cpp_object = static_cast<CppObject*>(object);
+        if(!cpp_object->finalizer_queued)
+        {
+            cpp_object->finalizer_queued = true;
+            finalizer_queue.push_back(cpp_object);
+        }
+        return true;
+    }
+
+    size_t GarbageCollector::run_finalizers(size_t max_count)
+    {
+        for(size_t i = 0; i < max_count && !finalizer_queue.empty(); i++)
+        {
+            CppObject* object = finalizer_queue.front();
+            finalizer_queue.pop_front();
+            object->finalizer(object->block);
+            bytes_allocated -= page_of(object)->slot_size;
+            free_object(object);
+        }
+        return finalizer_queue.size();
+    }
+
+    void GarbageCollector::release_empty_pages()
+    {
+        for(size_t i = 0; i < pages.size();)
+        {
+            Page* page = pages[i];
+            if(page->live_objects != 0 || page->needs_sweep || page == size_classes[page->size_class].current)
+            {
+                i++;
+                continue;
+            }
+
+            if(page->size_class != LARGE_OBJECTS && spare_pages.size() < MAX_SPARE_PAGES)
+            {
+                spare_pages.push_back(page);
+            }
+            else
+            {
+                ::operator delete(page, std::align_val_t(PAGE_SIZE));
+            }
+            pages[i] = pages.back();
+            pages.pop_back();
+        }
+
+        // The released pages may still be in the available lists, so they are rebuilt.
+        for(auto& sizes : size_classes)
+        {
+            sizes.available.clear();
+        }
+        for(Page* page : pages)
+        {
+            SizeClass& sizes = size_classes[page->size_class];
+            page->available = page->size_class != LARGE_OBJECTS && page != sizes.current && has_free_slot(page);
+            if(page->available)
+            {
+                sizes.available.push_back(page);
+            }
+        }
+    }
+
+    size_t GarbageCollector::string_internals(size_t length)
+    {
+        // Short texts are stored inside the std::string itself.
+        static const size_t inline_capacity = std::string().capacity();
+        return length > inline_capacity ? length + 1 : 0;
+    }
+
+    String* GarbageCollector::new_string(const std::string& text, bool interned)
+    {
+        size_t internals = string_internals(text.size());
+        charge(internals);
+        try
+        {
+            return new(*this) String(text, interned);
+        }
+        catch(...)
+        {
+            uncharge(internals);
+            throw;
+        }
+    }
+
+    String* GarbageCollector::create_string(const std::string& text)
+    {
+        if(text.size() <= MAX_SHORT_STRING_LENGTH)
+        {
+            return intern_string(text);
+        }
+        return new_string(text, false);
+    }
+
+    String* GarbageCollector::create_error_string(const std::string& text)
+    {
+        size_t limit = hard_limit;
+        hard_limit = SIZE_MAX;
+        try
+        {
+            String* string = create_string(text);
+            hard_limit = limit;
+            return string;
+        }
+        catch(...)
+        {
+            hard_limit = limit;
+            throw;
+        }
+    }
+
+    String* GarbageCollector::intern_string(const std::string& text)
+    {
+        auto it = interned_strings.find(text);
+        if(it != interned_strings.end())
+        {
+            return it->second;
+        }
+        String* string = new_string(text, true);
+        interned_strings[string->text] = string;
+        young_interned_strings.push_back(string);
+        return string;
+    }
+
+    String* GarbageCollector::intern_string(String* string)
+    {
+        if(string->interned)
+        {
+            return string;
+        }
+        return intern_string(string->text);
+    }
+
+    uint32_t GarbageCollector::type_id(const std::string& name)
+    {
+        auto it = type_ids.find(name);
+        if(it != type_ids.end())
+        {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(class_depths.size());
+        type_ids[name] = id;
+        class_depths.push_back(NO_CLASS_DEPTH);
+        return id;
+    }
+
+    void GarbageCollector::add_class_depth(uint32_t id, uint32_t depth)
+    {
+        uint32_t& known = class_depths[id];
+        if(known == NO_CLASS_DEPTH)
+        {
+            known = depth;
+        }
+        else if(known != depth)
+        {
+            known = MIXED_CLASS_DEPTH;
+        }
+    }
+
+    void GarbageCollector::collect(Data::Impl* data)
+    {
+        if(bytes_allocated >= soft_trigger)
+        {
+            collect_garbage(data);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool marking_done = concurrent_cycle ? marker_finished.load(std::memory_order_relaxed) : gray_stack.empty();
+        if(phase == Phase::MARKING && (marking_done || (step_size == 0 && !concurrent_cycle) || bytes_allocated >= next_collection))
+        {
+            finish_marking(data);
+        }
+        else
+        {
+            if(young_bytes >= nursery_size)
+            {
+                collect_young(data);
+            }
+            if(phase == Phase::IDLE && bytes_allocated >= next_collection)
+            {
+                start_cycle(data);
+            }
+        }
+
+        if(step_size == 0 && phase != Phase::IDLE && !concurrent_cycle)
+        {
+            if(phase == Phase::MARKING)
+            {
+                finish_marking(data);
+            }
+            work_done = 0;
+            sweep_old(SIZE_MAX);
+        }
+        record_pause(start);
     }
 
     void GarbageCollector::collect_garbage(Data::Impl* data)
     {
-        mark(data);
-        sweep();
+        auto start = std::chrono::steady_clock::now();
+        if(phase == Phase::SWEEPING)
+        {
+            work_done = 0;
+            sweep_old(SIZE_MAX);
+        }
+        if(phase == Phase::IDLE)
+        {
+            start_cycle(data);
+        }
+        finish_marking(data);
+        work_done = 0;
+        sweep_old(SIZE_MAX);
+        record_pause(start);
     }
 
-    static void mark_class(ClassType* class_type);
+    void GarbageCollector::collect_young(Data::Impl* data)
+    {
+        std::unique_lock<std::mutex> lock;
+        if(concurrent_cycle)
+        {
+            lock = pause_marker();
+        }
+
+        mark_mode = MarkMode::YOUNG;
+        mark_roots(data);
+        for(auto& value : remembered_set)
+        {
+            GCObject* object = to_gc_object(value);
+            object->remembered = false;
+            if(!object->old)
+            {
+                mark_value(value);
+            }
+            else if(!is_marked(object))
+            {
+                // Stored into an old object during a concurrent cycle.
+                set_mark(object);
+                if(value.get_type() != ValueType::STRING)
+                {
+                    gray_stack.push_back(value);
+                }
+            }
+        }
+        remembered_set.clear();
+        drain(young_gray_stack, SIZE_MAX);
+        mark_ephemerons(young_gray_stack);
+        clear_weak_references();
+        mark_mode = MarkMode::OLD;
 
-    static void mark_gc_object(Value& ref);
+        for(String* string : young_interned_strings)
+        {
+            if(!is_marked(string))
+            {
+                interned_strings.erase(string->text);
+            }
+        }
+        young_interned_strings.clear();
+
+        sweep_young();
+        release_empty_pages();
+        if(concurrent_cycle)
+        {
+            wake_marker();
+        }
+    }
 
-    static void mark_object(Object* object)
+    void GarbageCollector::start_cycle(Data::Impl* data)
     {
-        object->marked = true;
-        for(auto&[k, prop] : object->props)
+        phase = Phase::MARKING;
+        // If the steps can't keep up with the program, marking is finished in one pause once the heap has grown this much.
+        next_collection = bytes_allocated + std::max(bytes_allocated, minimum_threshold);
+        step_debt = 0;
+        mark_mode = MarkMode::OLD;
+        mark_roots(data);
+        if(concurrent_marking)
         {
-            mark_gc_object(prop.val);
+            std::lock_guard<std::mutex> lock(marker_mutex);
+            concurrent_cycle = true;
+            wake_marker();
         }
-        mark_class(object->type);
     }
 
-    static void mark_table(Table* table)
+    void GarbageCollector::finish_marking(Data::Impl* data)
     {
-        table->marked = true;
-        for(auto&[k, v] : table->keys)
+        if(concurrent_cycle)
         {
-            mark_gc_object(v);
+            stop_concurrent_cycle();
         }
+
+        // Roots are stored to without barriers and young objects aren't traced by the steps, so both are traced again.
+        mark_mode = MarkMode::ALL;
+        mark_roots(data);
+        for(auto& value : remembered_set)
+        {
+            to_gc_object(value)->remembered = false;
+            mark_value(value);
+        }
+        remembered_set.clear();
+        for(auto& value : snapshot_values)
+        {
+            mark_value(value);
+        }
+        snapshot_values.clear();
+        drain(gray_stack, SIZE_MAX);
+        partial_table = nullptr;
+        mark_ephemerons(gray_stack);
+        clear_weak_references();
+        mark_mode = MarkMode::OLD;
+
+        for(auto it = interned_strings.begin(); it != interned_strings.end();)
+        {
+            if(!is_marked(it->second))
+            {
+                it = interned_strings.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+        young_interned_strings.clear();
+
+        // Every page is swept once. Objects promoted into a page before it is swept keep their mark.
+        phase = Phase::SWEEPING;
+        next_collection = SIZE_MAX;
+        for(Page* page : pages)
+        {
+            page->needs_sweep = true;
+            size_classes[page->size_class].unswept.push_back(page);
+        }
+        unswept_pages = pages.size();
+        sweep_class = 0;
+        sweep_young();
     }
 
-    static void mark_class(ClassType* class_type)
+    void GarbageCollector::step(size_t budget)
     {
-        class_type->marked = true;
-        if(class_type->initializer)
+        work_done = 0;
+        if(phase == Phase::MARKING)
+        {
+            // Marking is finished at the next safe point once the gray stack is empty.
+            mark_step(budget);
+        }
+        else if(phase == Phase::SWEEPING)
         {
-            class_type->initializer->marked = true;
+            sweep_old(budget);
         }
+    }
+
+    void GarbageCollector::end_cycle()
+    {
+        phase = Phase::IDLE;
+        release_empty_pages();
+        next_collection = std::max(minimum_threshold, size_t(bytes_allocated * growth_factor));
+        update_soft_trigger();
+    }
 
-        for(auto&[k, method] : class_type->methods)
+    void GarbageCollector::run_marker()
+    {
+        std::unique_lock<std::mutex> lock(marker_mutex);
+        while(true)
         {
-            mark_gc_object(method.val);
+            marker_wake.wait(lock, [this]() { return stop_marker || (concurrent_cycle && !marker_finished); });
+            if(stop_marker)
+            {
+                return;
+            }
+
+            work_done = 0;
+            mark_step(MARKER_BATCH);
+            marker_finished = gray_stack.empty() && snapshot_values.empty();
+            if(program_waiting)
+            {
+                lock.unlock();
+                while(program_waiting)
+                {
+                    std::this_thread::yield();
+                }
+                lock.lock();
+            }
         }
+    }
 
-        for(auto&[k, setter] : class_type->setters)
+    std::unique_lock<std::mutex> GarbageCollector::pause_marker()
+    {
+        program_waiting = true;
+        std::unique_lock<std::mutex> lock(marker_mutex);
+        program_waiting = false;
+        return lock;
+    }
+
+    void GarbageCollector::wake_marker()
+    {
+        marker_finished = gray_stack.empty() && snapshot_values.empty();
+        if(!marker_finished)
+        {
+            marker_wake.notify_one();
+        }
+    }
+
+    void GarbageCollector::snapshot(const Value& container)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock = pause_marker();
+        GCObject* object = to_gc_object(container);
+        object->snapshotted = true;
+        // Whatever the object holds now was reachable when the cycle started, so it is all grayed before it can be overwritten.
+        // The object itself survives this cycle even if it is garbage.
+        set_mark(object);
+        if(container.get_type() == ValueType::TABLE && container.to_table()->keys.bucket_count() >= MIN_SLICED_BUCKETS)
+        {
+            snapshot_values.reserve(snapshot_values.size() + container.to_table()->keys.size() * 2);
+            for(auto&[k, v] : container.to_table()->keys)
+            {
+                snapshot_values.push_back(k);
+                snapshot_values.push_back(v);
+            }
+        }
+        else
+        {
+            trace_value(container);
+        }
+        wake_marker();
+        record_pause(start);
+    }
+
+    void GarbageCollector::stop_concurrent_cycle()
+    {
+        std::unique_lock<std::mutex> lock = pause_marker();
+        concurrent_cycle = false;
+        marker_finished = false;
+    }
+
+    void GarbageCollector::set_params(float growth_factor, size_t minimum_threshold)
+    {
+        this->growth_factor = std::max(growth_factor, 1.0f);
+        this->minimum_threshold = minimum_threshold;
+        if(phase == Phase::IDLE)
         {
-            mark_gc_object(setter.val);
+            next_collection = std::max(minimum_threshold, size_t(bytes_allocated * this->growth_factor));
         }
+    }
 
-        for(auto&[k, getter] : class_type->getters)
+    void GarbageCollector::set_nursery_size(size_t size)
+    {
+        nursery_size = size;
+    }
+
+    void GarbageCollector::set_step(size_t step_size, size_t work_per_step)
+    {
+        this->step_size = step_size;
+        this->work_per_step = std::max(work_per_step, size_t(1));
+    }
+
+    void GarbageCollector::set_concurrent_marking(bool enabled)
+    {
+        concurrent_marking = enabled;
+        if(enabled && !marker.joinable())
         {
-            mark_gc_object(getter.val);
+            marker = std::thread(&GarbageCollector::run_marker, this);
         }
+    }
 
-        for(auto&[k, method] : class_type->class_methods)
+    void GarbageCollector::record_pause(std::chrono::steady_clock::time_point start)
+    {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double microseconds = ms * 1000.0;
+        size_t bucket = 0;
+        while(bucket + 1 < GCPauseHistogram::BUCKET_COUNT && microseconds >= double(uint64_t(1) << bucket))
+        {
+            bucket++;
+        }
+        pauses.buckets[bucket]++;
+        pauses.pause_count++;
+        pauses.total_ms += ms;
+        pauses.max_ms = std::max(pauses.max_ms, ms);
+    }
+
+    bool GarbageCollector::visit(GCObject* object)
+    {
+        if(is_marked(object)
+            || (mark_mode == MarkMode::YOUNG && object->old)
+            || (mark_mode == MarkMode::OLD && !object->old))
+        {
+            return false;
+        }
+        set_mark(object);
+        return true;
+    }
+
+    void GarbageCollector::mark_value(const Value& value)
+    {
+        work_done++;
+        GCObject* object = to_gc_object(value);
+        // Strings don't reference anything, so they are black as soon as they are marked.
+        if(object == nullptr || !visit(object) || value.get_type() == ValueType::STRING)
+        {
+            return;
+        }
+
+        if(mark_mode == MarkMode::YOUNG)
+        {
+            young_gray_stack.push_back(value);
+            // The object is promoted with its mark, so the full collection in progress has to trace it too.
+            if(phase == Phase::MARKING)
+            {
+                gray_stack.push_back(value);
+            }
+        }
+        else
+        {
+            gray_stack.push_back(value);
+        }
+    }
+
+    void GarbageCollector::drain(std::vector<Value>& stack, size_t budget)
+    {
+        while(!stack.empty() && work_done < budget)
+        {
+            Value value = stack.back();
+            stack.pop_back();
+            trace_value(value);
+        }
+    }
+
+    void GarbageCollector::mark_step(size_t budget)
+    {
+        while(!snapshot_values.empty() && work_done < budget)
+        {
+            mark_value(snapshot_values.back());
+            snapshot_values.pop_back();
+        }
+        while(!gray_stack.empty() && work_done < budget)
         {
-            mark_gc_object(method.val);
+            size_t index = gray_stack.size() - 1;
+            Value value = gray_stack[index];
+            if(to_gc_object(value)->snapshotted)
+            {
+                // Traced by the program thread, which may be changing it now.
+                gray_stack.pop_back();
+                continue;
+            }
+            if(value.get_type() != ValueType::TABLE || value.to_table()->keys.bucket_count() < MIN_SLICED_BUCKETS)
+            {
+                gray_stack.pop_back();
+                trace_value(value);
+                continue;
+            }
+
+            // The table stays on the stack until all of it is traced, below the objects it grayed.
+            if(trace_table_slice(value.to_table(), budget))
+            {
+                gray_stack[index] = gray_stack.back();
+                gray_stack.pop_back();
+            }
         }
     }
 
-    static void mark_cpp_object(CppObject* object)
+    bool GarbageCollector::trace_table_slice(Table* table, size_t budget)
     {
-        object->marked = true;
-        for(auto&[k, ref] : object->props)
+        auto& keys = table->keys;
+        if(partial_table != table || partial_bucket_count != keys.bucket_count())
         {
-            mark_gc_object(ref.val);
+            partial_table = table;
+            partial_bucket = 0;
+            partial_bucket_count = keys.bucket_count();
+        }
+
+        // Entries added to the table since it was grayed were grayed by the write barrier.
+        while(partial_bucket < partial_bucket_count)
+        {
+            if(work_done >= budget)
+            {
+                return false;
+            }
+            for(auto it = keys.begin(partial_bucket); it != keys.end(partial_bucket); it++)
+            {
+                trace_entry(table, it->first, it->second);
+            }
+            partial_bucket++;
         }
-        mark_class(object->type);
+        partial_table = nullptr;
+        return true;
     }
 
-    static void mark_gc_object(Value& ref)
+    void GarbageCollector::trace_value(const Value& value)
     {
-        switch(ref.get_type())
+        switch(value.get_type())
         {
             case ValueType::SOURDO_FUNCTION:
-                ref.to_sourdo_function()->marked = true;
+                trace_function(value.to_sourdo_function());
                 break;
             case ValueType::OBJECT:
-                mark_object(ref.to_object());
+            case ValueType::CPP_OBJECT:
+            {
+                Object* object = value.get_type() == ValueType::OBJECT ? value.to_object() : value.to_cpp_object();
+                for(auto& slot : object->slots)
+                {
+                    mark_value(slot);
+                }
+                mark_value(object->type);
                 break;
+            }
             case ValueType::TABLE:
-                mark_table(ref.to_table());
+            {
+                Table* table = value.to_table();
+                for(auto&[k, v] : table->keys)
+                {
+                    trace_entry(table, k, v);
+                }
                 break;
+            }
             case ValueType::CLASS_TYPE:
-                mark_class(ref.to_class());
-                break;
-            case ValueType::CPP_OBJECT:
-                mark_cpp_object(ref.to_cpp_object());
+                trace_class(value.to_class());
                 break;
             default:
                 break;
         }
     }
 
-    void GarbageCollector::mark(Data::Impl* data)
+    void GarbageCollector::trace_function(SourDoFunction* function)
     {
-        while(data != nullptr)
+        for(auto& constant : function->bytecode.constants)
+        {
+            mark_value(constant);
+        }
+    }
+
+    void GarbageCollector::trace_class(ClassType* class_type)
+    {
+        mark_value(class_type->super);
+        mark_value(class_type->initializer);
+        trace_properties(class_type->methods);
+        trace_properties(class_type->setters);
+        trace_properties(class_type->getters);
+        trace_properties(class_type->class_methods);
+        // The names of the slots of every shape are the names the shapes after the first were made for.
+        for(size_t i = 1; i < class_type->shapes.size(); i++)
+        {
+            Shape* shape = class_type->shapes[i].get();
+            mark_value(shape->slots[shape->changed_slot].name);
+        }
+    }
+
+    void GarbageCollector::trace_properties(const std::unordered_map<String*, ClassType::Property>& properties)
+    {
+        for(auto&[k, property] : properties)
+        {
+            mark_value(k);
+            mark_value(property.val);
+        }
+    }
+
+    void GarbageCollector::trace_entry(const Table* table, const Value& key, const Value& value)
+    {
+        bool strong_key = !table->weak_keys || held_strongly(key);
+        if(strong_key)
+        {
+            mark_value(key);
+        }
+        // The values of weak keys are left to mark_ephemerons().
+        if(strong_key && (!table->weak_values || held_strongly(value)))
+        {
+            mark_value(value);
+        }
+    }
+
+    void GarbageCollector::mark_ephemerons(std::vector<Value>& stack)
+    {
+        bool marked_any = true;
+        while(marked_any)
         {
-            for(auto& ref : GlobalData::references)
+            marked_any = false;
+            for(Table* table : weak_tables)
             {
-                mark_gc_object(ref);
+                // Minor collections only trace young tables.
+                bool traced = is_marked(table) && (mark_mode != MarkMode::YOUNG || !table->old);
+                if(!table->weak_keys || table->weak_values || !traced)
+                {
+                    continue;
+                }
+                for(auto&[k, v] : table->keys)
+                {
+                    if(is_alive(k) && !is_alive(v))
+                    {
+                        mark_value(v);
+                        marked_any = true;
+                    }
+                }
             }
+            drain(stack, SIZE_MAX);
+        }
+    }
+
+    void GarbageCollector::clear_weak_references()
+    {
+        for(size_t i = 0; i < weak_tables.size();)
+        {
+            Table* table = weak_tables[i];
+            if(!is_alive(table) || (!table->weak_keys && !table->weak_values))
+            {
+                weak_tables[i] = weak_tables.back();
+                weak_tables.pop_back();
+                continue;
+            }
+            i++;
 
+            // Old tables only hold young objects through the remembered set, which keeps them alive.
+            if(mark_mode == MarkMode::YOUNG && table->old)
+            {
+                continue;
+            }
+            for(auto it = table->keys.begin(); it != table->keys.end();)
+            {
+                if((table->weak_keys && !is_alive(it->first)) || (table->weak_values && !is_alive(it->second)))
+                {
+                    it = table->keys.erase(it);
+                }
+                else
+                {
+                    it++;
+                }
+            }
+        }
+
+        auto clear_reference = [this](Reference& reference)
+        {
+            if(reference.in_use && reference.weak && !is_alive(reference.value))
+            {
+                reference.value = Null();
+            }
+        };
+        // The other refs hold old objects, which minor collections don't free.
+        if(mark_mode == MarkMode::YOUNG)
+        {
+            for(uint32_t slot : young_references)
+            {
+                clear_reference(references[slot]);
+            }
+        }
+        else
+        {
+            for(auto& reference : references)
+            {
+                clear_reference(reference);
+            }
+        }
+    }
+
+    bool GarbageCollector::held_strongly(const Value& value)
+    {
+        return value.get_type() == ValueType::STRING || to_gc_object(value) == nullptr;
+    }
+
+    bool GarbageCollector::is_alive(const Value& value) const
+    {
+        GCObject* object = to_gc_object(value);
+        return object == nullptr || is_marked(object) || (mark_mode == MarkMode::YOUNG && object->old);
+    }
+
+    void GarbageCollector::mark_roots(Data::Impl* data)
+    {
+        if(mark_mode == MarkMode::YOUNG)
+        {
+            for(uint32_t slot : young_references)
+            {
+                if(!references[slot].weak)
+                {
+                    mark_value(references[slot].value);
+                }
+            }
+        }
+        else
+        {
+            for(auto& reference : references)
+            {
+                if(!reference.weak)
+                {
+                    mark_value(reference.value);
+                }
+            }
+        }
+
+        while(data != nullptr)
+        {
             for(auto&[k, ref] : data->symbol_table)
             {
-                mark_gc_object(ref.val);
+                mark_value(k);
+                mark_value(ref.val);
             }
 
-            for(auto& ref : data->stack)
+            for(auto&[k, slot] : data->global_slots)
             {
-                mark_gc_object(ref);
+                mark_value(k);
+                mark_value(data->globals[slot].val);
+            }
+
+            // The root scope holds the values of every scope.
+            if(data->parent == nullptr)
+            {
+                for(auto& ref : data->stack_values)
+                {
+                    mark_value(ref);
+                }
             }
             data = data->parent;
         }
     }
 
-    void GarbageCollector::sweep()
+    void GarbageCollector::sweep_old(size_t budget)
     {
-        auto& obj = objects;
-        auto it = objects.begin();
-        while(it != objects.end())
+        while(unswept_pages != 0 && work_done < budget)
         {
-            if((*it)->marked)
+            SizeClass& sizes = size_classes[sweep_class];
+            if(sizes.unswept.empty())
             {
-                (*it)->marked = false;
-                it++;
+                sweep_class = (sweep_class + 1) % size_classes.size();
+                continue;
+            }
+            Page* page = sizes.unswept.back();
+            sizes.unswept.pop_back();
+            unswept_pages--;
+            sweep_page(page);
+        }
+
+        if(unswept_pages == 0)
+        {
+            end_cycle();
+        }
+    }
+
+    void GarbageCollector::sweep_page(Page* page)
+    {
+        page->needs_sweep = false;
+        for(size_t offset = FIRST_SLOT_OFFSET; offset < page->unused_offset; offset += page->slot_size)
+        {
+            size_t granule = offset / GRANULE;
+            if(!((page->live_bits[granule / 64] >> (granule % 64)) & 1))
+            {
+                continue;
+            }
+            work_done++;
+
+            // Young objects are left to the minor collections.
+            GCObject* object = reinterpret_cast<GCObject*>(reinterpret_cast<uint8_t*>(page) + offset);
+            if(!object->old)
+            {
+                continue;
+            }
+            if(is_marked(object))
+            {
+                object->snapshotted = false;
+            }
+            else if(!queue_finalizer(object))
+            {
+                bytes_allocated -= page->slot_size;
+                free_object(object);
+            }
+        }
+        std::fill(std::begin(page->mark_bits), std::end(page->mark_bits), 0);
+    }
+
+    void GarbageCollector::sweep_young()
+    {
+        for(GCObject* object : young_objects)
+        {
+            Page* page = page_of(object);
+            if(is_marked(object))
+            {
+                // Survivors promoted while a full collection marks keep their mark, they are already on its gray stack.
+                // So do those in pages that are still to be swept, or the sweep would take them for dead.
+                if(phase != Phase::MARKING && !page->needs_sweep)
+                {
+                    clear_mark(object);
+                }
+                object->old = true;
+            }
+            else if(queue_finalizer(object))
+            {
+                // Queued objects are kept with the old ones, unmarked, until their finalizer runs.
+                object->old = true;
             }
             else
             {
-                delete (*it);
-                it = objects.erase(it);
+                bytes_allocated -= page->slot_size;
+                free_object(object);
             }
         }
+        young_objects.clear();
+        young_bytes = 0;
+        young_references.clear();
     }
 } // namespace sourdo
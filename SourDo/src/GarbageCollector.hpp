@@ -1,20 +1,524 @@
 #pragma once
 
 #include "SourDoData.hpp"
+#include "Datatypes/Function.hpp"
 
 #include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <array>
+#include <cstdint>
+#include <cstddef>
 
 namespace sourdo
 {
+    // Returns the heap object held by 'value', or nullptr if it doesn't hold one.
+    inline GCObject* to_gc_object(const Value& value)
+    {
+        switch(value.get_type())
+        {
+            case ValueType::STRING:
+                return value.to_string();
+            case ValueType::SOURDO_FUNCTION:
+                return value.to_sourdo_function();
+            case ValueType::OBJECT:
+                return value.to_object();
+            case ValueType::TABLE:
+                return value.to_table();
+            case ValueType::CLASS_TYPE:
+                return value.to_class();
+            case ValueType::CPP_OBJECT:
+                return value.to_cpp_object();
+            default:
+                return nullptr;
+        }
+    }
+
+    /* The heap of one state. Each root Data owns one, and every object and interned string
+     * it creates is registered here, so states don't share anything and can run on different threads.
+     *
+     * Memory is split into pages of one size class each, so the slots of dead objects are reused by new objects of
+     * the same size. The mark bits of the objects of a page live in a bitmap at its start.
+     *
+     * Objects are generational. New objects are young until they survive a collection, which promotes them to the
+     * old generation in place. Minor collections only trace and sweep young objects, starting from the roots and from
+     * the young objects that were stored into old ones, so every store of a value into an object must go through
+     * write_barrier().
+     *
+     * Full collections of the old generation are incremental. Marking is tri-color: white objects are unmarked,
+     * gray ones are marked and on the gray stack, black ones are marked and traced. A cycle marks the old objects
+     * reachable from the roots, then traces gray objects a step at a time as memory is allocated. Once the gray
+     * stack is empty, a final pause at a safe point rescans the roots and the young generation, then the pages are
+     * swept a step at a time, or earlier when an allocation needs a page of their size class. While marking, the write
+     * barrier grays white old objects stored into marked ones, so black objects never point to white ones.
+     *
+     * With concurrent marking enabled, the marking of a full collection runs on a background thread instead of in steps.
+     * Roots are still scanned on the thread that runs the program, and so are minor collections, while the background
+     * thread waits. The containers of a state aren't safe to read while they change, so snapshot_barrier() must run
+     * before every store: the first store into an old object while marking grays what it holds on the program thread
+     * and hands it over from the background thread, which skips it from then on. Values stored meanwhile are remembered and
+     * grayed when the background thread is paused.
+     */
     class GarbageCollector
     {
     public:
-        static void add_object(GCObject* object);
-        static void collect_garbage(Data::Impl* data);
+        GarbageCollector();
+        GarbageCollector(const GarbageCollector&) = delete;
+        GarbageCollector& operator=(const GarbageCollector&) = delete;
+        // Frees every object that is still on the heap.
+        ~GarbageCollector();
+
+        // Returns memory for a new young object of 'size' bytes and registers it.
+        void* allocate(size_t size);
+        // Forgets the object allocated last. Used when its constructor throws.
+        void remove_last_object();
+
+        // Counts memory owned by an object towards the usage of the heap. Throws SourDoError instead if that would take
+        // the heap past its hard limit.
+        void charge(size_t size);
+        void uncharge(size_t size)
+        {
+            bytes_allocated -= size;
+        }
+
+        /**
+         * @brief Records that 'value' was stored in 'container'. Must be called after every such store.
+         */
+        void write_barrier(const Value& container, const Value& value)
+        {
+            GCObject* container_object = to_gc_object(container);
+            if(!container_object->old)
+            {
+                return;
+            }
+            GCObject* object = to_gc_object(value);
+            if(object == nullptr)
+            {
+                return;
+            }
+
+            // The background thread may be reading the marks, so old objects are grayed once it is paused.
+            if(!object->old || concurrent_cycle)
+            {
+                if(!object->remembered)
+                {
+                    object->remembered = true;
+                    remembered_set.push_back(value);
+                }
+            }
+            else if(phase == Phase::MARKING && is_marked(container_object) && !is_marked(object))
+            {
+                set_mark(object);
+                gray_stack.push_back(value);
+            }
+        }
+
+        /**
+         * @brief Must be called before every store into 'container', and before anything else that may change its layout.
+         */
+        void snapshot_barrier(const Value& container)
+        {
+            if(concurrent_cycle)
+            {
+                GCObject* object = to_gc_object(container);
+                if(object->old && !object->snapshotted)
+                {
+                    snapshot(container);
+                }
+            }
+        }
+
+        /**
+         * @brief Marks everything reachable from 'data' and frees the rest, in both generations, in one pause.
+         * Finishes the full collection in progress first, if there is one.
+         */
+        void collect_garbage(Data::Impl* data);
+
+        /**
+         * @brief Collects the young generation once the nursery is full, starts a full collection once the whole heap
+         * has grown past the threshold set by the last one, and finishes the marking of the full collection in progress
+         * once its gray stack is empty. Must only be called when every live value is reachable from 'data'.
+         */
+        void collect_if_needed(Data::Impl* data)
+        {
+            if(young_bytes >= nursery_size || bytes_allocated >= next_collection || bytes_allocated >= soft_trigger
+                || (phase == Phase::MARKING && (concurrent_cycle ? marker_finished.load(std::memory_order_relaxed) : gray_stack.empty())))
+            {
+                collect(data);
+            }
+        }
+
+        /**
+         * @brief After a full collection, the next one starts once the heap reaches 'growth_factor' times the size
+         * that survived, but never before it reaches 'minimum_threshold' bytes.
+         */
+        void set_params(float growth_factor, size_t minimum_threshold);
+
+        /**
+         * @brief A minor collection runs each time 'size' bytes of new objects have been allocated.
+         */
+        void set_nursery_size(size_t size);
+
+        /**
+         * @brief While a full collection runs, every 'step_size' bytes allocated do at most 'work_per_step' units of its work.
+         * With a 'step_size' of 0, full collections run in one pause.
+         */
+        void set_step(size_t step_size, size_t work_per_step);
+
+        /**
+         * @brief Marks the next full collections on a background thread, which is started the first time this is enabled.
+         */
+        void set_concurrent_marking(bool enabled);
+
+        /**
+         * @brief Runs at most 'max_count' queued finalizers and frees their objects. Returns how many are still queued.
+         */
+        size_t run_finalizers(size_t max_count);
+
+        /**
+         * @brief Returns the bytes used by the objects on the heap, the text of its strings and the entries of its tables.
+         */
+        size_t get_memory_usage() const
+        {
+            return bytes_allocated;
+        }
+
+        /**
+         * @brief Once the heap reaches 'soft_limit' bytes, the next safe point runs a full collection in one pause.
+         * Allocations that would take it past 'hard_limit' bytes throw SourDoError.
+         */
+        void set_memory_limits(size_t soft_limit, size_t hard_limit);
+
+        /**
+         * @brief Creates a string on the heap. Short strings are interned.
+         */
+        String* create_string(const std::string& text);
+
+        /**
+         * @brief Like create_string(), but ignores the hard limit, so that running out of memory can still be reported.
+         */
+        String* create_error_string(const std::string& text);
+
+        /**
+         * @brief Returns the interned string with the given text, creating it if needed.
+         */
+        String* intern_string(const std::string& text);
+        String* intern_string(String* string);
+
+        /**
+         * @brief Returns the id of the type named 'name'. Classes with the same name share an id, which private access
+         * and isa checks compare instead of the name. Builtin types have the ids of BuiltinType, and 0 stands for code
+         * outside of any class.
+         */
+        uint32_t type_id(const std::string& name);
+
+        /**
+         * @brief Records that a class with the id 'id' has 'depth' base classes.
+         */
+        void add_class_depth(uint32_t id, uint32_t depth);
+
+        /**
+         * @brief Returns how many base classes the classes with the id 'id' have. Returns NO_CLASS_DEPTH if there
+         * are none, or MIXED_CLASS_DEPTH if they differ.
+         */
+        uint32_t class_depth(uint32_t id) const
+        {
+            return class_depths[id];
+        }
+        static constexpr uint32_t NO_CLASS_DEPTH = UINT32_MAX - 1;
+        static constexpr uint32_t MIXED_CLASS_DEPTH = UINT32_MAX;
+
+        /**
+         * @brief Keeps 'value' alive until the returned ref is removed. Weak refs don't, and are set to null
+         * once their value is collected.
+         */
+        GCRef create_ref(const Value& value, bool weak);
+        void remove_ref(GCRef ref);
+
+        /**
+         * @brief Returns the value of the ref, or nullptr if it was removed or never existed.
+         */
+        const Value* find_ref(GCRef ref) const;
+
+        /**
+         * @brief Sets which parts of the entries of 'table' are weak.
+         */
+        void set_weakness(Table* table, bool weak_keys, bool weak_values);
+
+        GCPauseHistogram pauses;
     private:
-        static std::vector<GCObject*> objects;
+        static constexpr size_t PAGE_SIZE = 32 * 1024;
+        // Objects are aligned to, and their sizes rounded up to, granules.
+        static constexpr size_t GRANULE = alignof(std::max_align_t);
+        static constexpr size_t BITMAP_WORDS = PAGE_SIZE / GRANULE / 64;
+        // 16 byte steps up to 256 bytes, then four classes per doubling. Bigger objects get a page of their own.
+        static constexpr std::array<size_t, 24> SIZE_CLASSES = {
+            16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+            320, 384, 448, 512, 640, 768, 896, 1024,
+        };
+        // The size class of the pages that hold one big object.
+        static constexpr size_t LARGE_OBJECTS = SIZE_CLASSES.size();
+        // Empty pages kept around for reuse.
+        static constexpr size_t MAX_SPARE_PAGES = 16;
+        // Tables with fewer buckets are traced in one go.
+        static constexpr size_t MIN_SLICED_BUCKETS = 1024;
+        // Units of work the background thread does before it lets the program thread take the heap.
+        static constexpr size_t MARKER_BATCH = 1000;
+
+        // The header of a page, followed by its slots. Pages are aligned to PAGE_SIZE, so the page of an object is found
+        // from its address. Bit i of the bitmaps stands for the object that starts at granule i of the page.
+        struct Page
+        {
+            uint64_t mark_bits[BITMAP_WORDS];
+            // Set for the slots that hold an object.
+            uint64_t live_bits[BITMAP_WORDS];
+            size_t size_class;
+            size_t slot_size;
+            // Slots from here on have never been handed out.
+            size_t unused_offset;
+            // Freed slots, linked through their first bytes.
+            void* free_slots;
+            // Objects of either generation in this page.
+            size_t live_objects;
+            // Set from the end of the marking of a full collection until the sweep reaches the page.
+            bool needs_sweep;
+            // Set while the page is in the available list of its size class.
+            bool available;
+        };
+        static constexpr size_t FIRST_SLOT_OFFSET = (sizeof(Page) + GRANULE - 1) / GRANULE * GRANULE;
+
+        struct SizeClass
+        {
+            // The page new objects of this size class are allocated in.
+            Page* current = nullptr;
+            // Other pages with free slots.
+            std::vector<Page*> available;
+            // Pages the sweep of the current full collection hasn't reached yet.
+            std::vector<Page*> unswept;
+        };
+
+        enum class Phase
+        {
+            IDLE,
+            MARKING,
+            SWEEPING,
+        };
+
+        // Which objects visit() marks.
+        enum class MarkMode
+        {
+            YOUNG,
+            OLD,
+            ALL,
+        };
+
+        std::vector<GCObject*> young_objects;
+        std::vector<Page*> pages;
+        std::vector<Page*> spare_pages;
+        std::array<SizeClass, SIZE_CLASSES.size() + 1> size_classes;
+        size_t unswept_pages = 0;
+        // The size class the sweep steps take pages from.
+        size_t sweep_class = 0;
+        // Young objects that were stored into old objects. Minor collections treat them as roots, which keeps the cost
+        // of a store independent of the size of the object it was stored into. During a concurrent cycle, old objects
+        // stored into old objects are added too, and grayed by the next collection.
+        std::vector<Value> remembered_set;
+
+        Phase phase = Phase::IDLE;
+        MarkMode mark_mode = MarkMode::OLD;
+        // Gray objects of the full collection in progress.
+        std::vector<Value> gray_stack;
+        // Gray objects of a minor collection, which are traced without touching the ones above.
+        std::vector<Value> young_gray_stack;
+        size_t step_size = 16 * 1024;
+        size_t work_per_step = 3000;
+        // Bytes allocated since the last step.
+        size_t step_debt = 0;
+        // References scanned and objects swept by the current step.
+        size_t work_done = 0;
+        // The table whose buckets below 'partial_bucket' have been traced by the previous steps.
+        Table* partial_table = nullptr;
+        size_t partial_bucket = 0;
+        // A rehash moves the entries between buckets, so the table is traced again from the start.
+        size_t partial_bucket_count = 0;
+
+        bool concurrent_marking = false;
+        // Set while the background thread marks the current cycle. Only changed by the program thread,
+        // with 'marker_mutex' held, so that thread can read it without locking.
+        bool concurrent_cycle = false;
+        bool stop_marker = false;
+        std::thread marker;
+        // Held by the background thread while it marks, and by the program thread whenever it touches the marks,
+        // the gray stack or the generation of an object during a concurrent cycle.
+        std::mutex marker_mutex;
+        std::condition_variable marker_wake;
+        // Set by the background thread when it runs out of gray objects.
+        std::atomic<bool> marker_finished{false};
+        // Set while the program thread waits for 'marker_mutex', the background thread yields to it between batches.
+        std::atomic<bool> program_waiting{false};
+        // The entries of big tables, copied before their first store of a concurrent cycle for the background thread to mark.
+        // Copying them is quicker than marking them on the program thread.
+        std::vector<Value> snapshot_values;
+
+        // Bytes used by the objects of both generations, and by what they own.
+        size_t bytes_allocated = 0;
+        size_t soft_limit = SIZE_MAX;
+        size_t hard_limit = SIZE_MAX;
+        // Usage at which the next forced collection runs. Raised above the soft limit while what survives doesn't fit
+        // under it, so that the program isn't collected at every safe point.
+        size_t soft_trigger = SIZE_MAX;
+        // Bytes used by the young objects.
+        size_t young_bytes = 0;
+        size_t nursery_size = 256 * 1024;
+        size_t next_collection = 1024 * 1024;
+        float growth_factor = 2.0f;
+        size_t minimum_threshold = 1024 * 1024;
+        // Weak: interned strings are removed from this table when they are collected.
+        std::unordered_map<std::string_view, String*> interned_strings;
+        // Interned strings created since the last collection. Only these can die in a minor collection.
+        std::vector<String*> young_interned_strings;
+        // Only grow, the names of classes a state compiles are few. Indexed by type id.
+        std::unordered_map<std::string, uint32_t> type_ids;
+        std::vector<uint32_t> class_depths;
+        // A slot of the ref table.
+        struct Reference
+        {
+            Value value;
+            // Bumped each time the slot is freed, so that refs to its earlier values are no longer valid.
+            uint32_t generation = 0;
+            bool in_use = false;
+            bool weak = false;
+            // The next free slot, while this one is free.
+            uint32_t next_free = NO_REFERENCE;
+        };
+        static constexpr uint32_t NO_REFERENCE = UINT32_MAX;
+
+        // Values kept alive for the host through GCRefs.
+        std::vector<Reference> references;
+        uint32_t free_references = NO_REFERENCE;
+        // Slots that got a value since the last collection. Minor collections only mark these, the values of the
+        // others are old.
+        std::vector<uint32_t> young_references;
+        // Tables that have been made weak. Dead ones are dropped after each marking.
+        std::vector<Table*> weak_tables;
+        // Dead CppObjects whose finalizer hasn't run yet. They keep their memory until it does, but nothing
+        // traces them, so what they reference may already be freed.
+        std::deque<CppObject*> finalizer_queue;
+
+        void collect(Data::Impl* data);
+        void collect_young(Data::Impl* data);
+
+        // Grays the old objects referenced by the roots and starts tracing them incrementally.
+        void start_cycle(Data::Impl* data);
+        // Marks everything that is still white but reachable, then starts sweeping.
+        void finish_marking(Data::Impl* data);
+        // Does at most 'budget' units of the work of the current phase.
+        void step(size_t budget);
+        void end_cycle();
+
+        // The loop of the background thread.
+        void run_marker();
+        // Waits for the background thread to finish its batch and keeps it paused until the lock is released.
+        std::unique_lock<std::mutex> pause_marker();
+        // Lets the background thread go on if there is marking left to do. 'marker_mutex' must be held.
+        void wake_marker();
+        // Grays what the old object in 'container' holds before it is first stored to during a concurrent cycle.
+        void snapshot(const Value& container);
+        // Stops the background thread from marking the current cycle.
+        void stop_concurrent_cycle();
+
+        void mark_roots(Data::Impl* data);
+        // Marks 'object' if 'mark_mode' covers it and returns true if its references still have to be traced.
+        bool visit(GCObject* object);
+        // Marks the object in 'value' and pushes it to the gray stack of the current mark mode.
+        void mark_value(const Value& value);
+        // Traces gray objects until the stack is empty or 'budget' units of work are done.
+        void drain(std::vector<Value>& stack, size_t budget);
+        // Like drain() on the gray stack, but tables are traced a slice of buckets at a time.
+        void mark_step(size_t budget);
+        // Traces the next slice of 'table' and returns true once all of it has been traced.
+        bool trace_table_slice(Table* table, size_t budget);
+        // Marks the references held by the object in 'value', which must already be marked.
+        void trace_value(const Value& value);
+        void trace_function(SourDoFunction* function);
+        void trace_class(ClassType* class_type);
+        void trace_properties(const std::unordered_map<String*, ClassType::Property>& properties);
+        // Marks the parts of a table entry that the table holds strongly.
+        void trace_entry(const Table* table, const Value& key, const Value& value);
+        // Marks the values of weak keys that are alive, until that marks nothing new.
+        void mark_ephemerons(std::vector<Value>& stack);
+        // Removes the dead entries of weak tables and clears the weak refs to dead objects.
+        void clear_weak_references();
+        // True for values that weak tables and weak refs hold like the values that don't live on the heap.
+        static bool held_strongly(const Value& value);
+        // Whether the marking of the current mark mode found 'value' alive. Objects it doesn't cover are alive.
+        bool is_alive(const Value& value) const;
+
+        static Page* page_of(const GCObject* object)
+        {
+            return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(object) & ~(PAGE_SIZE - 1));
+        }
+
+        static size_t granule_of(const GCObject* object)
+        {
+            return (reinterpret_cast<uintptr_t>(object) & (PAGE_SIZE - 1)) / GRANULE;
+        }
+
+        static bool is_marked(const GCObject* object)
+        {
+            size_t granule = granule_of(object);
+            return (page_of(object)->mark_bits[granule / 64] >> (granule % 64)) & 1;
+        }
+
+        static void set_mark(GCObject* object)
+        {
+            size_t granule = granule_of(object);
+            page_of(object)->mark_bits[granule / 64] |= uint64_t(1) << (granule % 64);
+        }
+
+        static void clear_mark(GCObject* object)
+        {
+            size_t granule = granule_of(object);
+            page_of(object)->mark_bits[granule / 64] &= ~(uint64_t(1) << (granule % 64));
+        }
+
+        static size_t size_class_of(size_t size);
+        static bool has_free_slot(const Page* page);
+        // Hands out a free slot of the page, reusing freed slots first.
+        static GCObject* take_slot(Page* page);
+        // Finds a page with free slots for the current page of a size class, sweeping its unswept pages first.
+        Page* next_page(size_t size_class);
+        Page* new_page(size_t size_class, size_t slot_size);
+        // Returns the slot of an object that was never constructed, or was already destroyed, to its page.
+        void release_slot(GCObject* object);
+        // Runs the destructor of the object's type.
+        static void destroy_object(GCObject* object);
+        void free_object(GCObject* object);
+        // Creates a string and charges its text.
+        String* new_string(const std::string& text, bool interned);
+        // The bytes a string of 'length' characters is charged for its text, on top of its object.
+        static size_t string_internals(size_t length);
+        // Throws the error of a failed allocation of 'size' bytes.
+        [[noreturn]] void out_of_memory(size_t size);
+        void update_soft_trigger();
+        // Queues the finalizer of a dead object, if it has one, and returns true if the object must be kept until it runs.
+        bool queue_finalizer(GCObject* object);
 
-        static void mark(Data::Impl* data);
-        static void sweep();
+        // Sweeps unswept pages until 'budget' objects have been looked at. Survivors have their marks cleared.
+        void sweep_old(size_t budget);
+        void sweep_page(Page* page);
+        // Young survivors are promoted to the old generation.
+        void sweep_young();
+        void record_pause(std::chrono::steady_clock::time_point start);
+        // Returns empty pages, other than the current ones, to the spare list or frees them.
+        void release_empty_pages();
     };
 } // namespace sourdo
@@ -1,79 +1,83 @@
 #include "GlobalData.hpp"
+#include "GarbageCollector.hpp"
+
+#include <algorithm>
 
 namespace sourdo
 {
-    std::vector<Value> GlobalData::references;
-
-    bool check_value_type(const Value& value, const std::string& name)
+    // Classes keep the ids of their base classes by depth, so a class with a known depth is looked for at that depth only.
+    static bool inherits(const ClassType* type, uint32_t type_id, const GarbageCollector& heap)
     {
-        auto find_class_name = [name](ClassType* type) -> bool
+        if(type == nullptr)
         {
-            while(type != nullptr)
-            {
-                if(type->name == name)
-                {
-                    return true;
-                }
-                type = type->super;
-            }
-            return name == "object";
-        };
+            return false;
+        }
+        uint32_t depth = heap.class_depth(type_id);
+        if(depth == GarbageCollector::MIXED_CLASS_DEPTH)
+        {
+            return std::find(type->ancestors.begin(), type->ancestors.end(), type_id) != type->ancestors.end();
+        }
+        return depth < type->ancestors.size() && type->ancestors[depth] == type_id;
+    }
 
+    bool check_value_type(const Value& value, uint32_t type_id, const GarbageCollector& heap)
+    {
+        BuiltinType type = static_cast<BuiltinType>(type_id);
         switch(value.get_type())
         {
             case ValueType::_NULL:
             {
-                return name == "null_type";
+                return type == BuiltinType::_NULL;
                 break;
             }
             case ValueType::NUMBER:
             {
-                return name == "number";
+                return type == BuiltinType::NUMBER;
                 break;
             }
             case ValueType::BOOL:
             {
-                return name == "bool";
+                return type == BuiltinType::BOOL;
                 break;
             }
             case ValueType::STRING:
             {
-                return name == "string";
+                return type == BuiltinType::STRING;
                 break;
             }
             case ValueType::SOURDO_FUNCTION:
             {
-                return name == "sourdo_function" || name == "function";
+                return type == BuiltinType::SOURDO_FUNCTION || type == BuiltinType::FUNCTION;
                 break;
             }
             case ValueType::CPP_FUNCTION:
             {
-                return name == "cpp_function" ||  name == "function";
+                return type == BuiltinType::CPP_FUNCTION || type == BuiltinType::FUNCTION;
                 break;
             }
             case ValueType::VALUE_REF:
             {
-                return check_value_type(*(value.to_value_ref()), name);
+                return check_value_type(*(value.to_value_ref()), type_id, heap);
                 break;
             }
             case ValueType::TABLE:
             {
-                return name == "table";
+                return type == BuiltinType::TABLE;
                 break;
             }
             case ValueType::OBJECT:
             {
-                return find_class_name(value.to_object()->type);
+                return type == BuiltinType::OBJECT || inherits(value.to_object()->type, type_id, heap);
                 break;
             }
             case ValueType::CLASS_TYPE:
             {
-                return name == "class_type";
+                return type == BuiltinType::CLASS_TYPE;
                 break;
             }
             case ValueType::CPP_OBJECT:
             {
-                return find_class_name(value.to_cpp_object()->type);
+                return type == BuiltinType::OBJECT || inherits(value.to_cpp_object()->type, type_id, heap);
                 break;
             }
         }
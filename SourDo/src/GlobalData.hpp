@@ -6,11 +6,26 @@
 
 namespace sourdo
 {
-    class GlobalData
+    // The type ids of the builtin type names, see GarbageCollector::type_id.
+    enum class BuiltinType : uint32_t
     {
-    public:
-        static std::vector<Value> references;
+        _NULL = 1,
+        NUMBER,
+        BOOL,
+        STRING,
+        FUNCTION,
+        SOURDO_FUNCTION,
+        CPP_FUNCTION,
+        TABLE,
+        CLASS_TYPE,
+        OBJECT,
     };
 
-    bool check_value_type(const Value& value, const std::string& name);
+    // The names of the builtin types, in the order of their ids.
+    inline constexpr const char* builtin_type_names[] = {
+        "null_type", "number", "bool", "string", "function", "sourdo_function", "cpp_function", "table", "class_type", "object",
+    };
+
+    // Returns whether 'value' is of the type with the id 'type_id', given out by 'heap'.
+    bool check_value_type(const Value& value, uint32_t type_id, const GarbageCollector& heap);
 } // namespace sourdo
@@ -1255,6 +1255,9 @@ namespace sourdo
             {Token::Type::TK_EOF,           {nullptr,               nullptr,                    ExprPrecedence::NONE        }},
         };
 
-        return rules[type];
+        // Lookups must not insert: the table is shared by every state's parser.
+        static ParseExprRule no_rule = {nullptr, nullptr, ExprPrecedence::NONE};
+        auto rule = rules.find(type);
+        return rule != rules.end() ? rule->second : no_rule;
     }
 } // namespace sourdo
@@ -14,59 +14,111 @@
 
 namespace sourdo
 {
+    static std::optional<std::string> run_main_chunk(const Bytecode& bytecode, Data::Impl* impl)
+    {
+        // The chunk is kept on the stack while it runs so that the collector can see its constants.
+        SourDoFunction* main_chunk;
+        try
+        {
+            main_chunk = new(*impl->heap) SourDoFunction(0, 0, bytecode);
+        }
+        catch(const SourDoError& err)
+        {
+            return bytecode.file_name + "(Runtime Error): " + err.what();
+        }
+        size_t chunk_index = impl->stack.size();
+        impl->stack.push_back(main_chunk);
+
+        // The chunk's local slots sit right above it.
+        Data::Impl* root = impl->get_root();
+        size_t scope_depth = root->scopes_in_use;
+        VirtualMachine vm;
+        std::optional<std::string> error = vm.run_frame(main_chunk->bytecode, impl, chunk_index + 1);
+        if(error)
+        {
+            // A runtime error leaves the scopes and values of the calls it happened in behind.
+            root->pop_scopes(scope_depth);
+            impl->stack.resize(chunk_index);
+            // Frees what the failed code left behind if it ran out of memory, so the error can be reported.
+            impl->heap->collect_if_needed(impl);
+            return error;
+        }
+        impl->stack.erase(impl->stack.begin() + chunk_index, impl->stack.begin() + chunk_index + 1 + main_chunk->bytecode.slot_count);
+        return error;
+    }
+
+    // Tokenizes, parses and compiles 'source' into 'result'. Compiling interns strings on the heap, so it can run out of memory too.
+    static std::optional<std::string> compile(const std::string& source, const std::string& file_name, Data::Impl* impl,
+        BytecodeGenerator::Result& result)
+    {
+        // Code that ran out of memory before leaves the heap due for a collection, which may free enough to compile.
+        impl->heap->collect_if_needed(impl);
+        try
+        {
+            auto[tokens, tok_error] = tokenize_string(source, file_name);
+            if(tok_error)
+            {
+                return tok_error;
+            }
+
+            Parser parser;
+            auto[ast, parse_error] = parser.parse_tokens(tokens);
+            if(parse_error)
+            {
+                return parse_error;
+            }
+
+            BytecodeGenerator byte_gen(*impl->heap);
+            result = byte_gen.generate_bytecode(ast);
+            return result.error;
+        }
+        catch(const SourDoError& err)
+        {
+            return file_name + "(Runtime Error): " + err.what();
+        }
+    }
+
+    // Pushes the message of an error that stopped do_string() or do_file(). The heap may be full, so the message
+    // is allocated past the hard limit, after collecting what the failed code left behind.
+    static void push_error(const std::string& error, Data::Impl* impl)
+    {
+        std::stringstream ss;
+        ss << COLOR_RED << error << COLOR_DEFAULT << std::flush;
+        impl->heap->collect_if_needed(impl);
+        impl->stack.emplace_back(impl->heap->create_error_string(ss.str()));
+    }
+
     Data::Data()
     {
         impl = new Impl();
+        impl->owned_heap = std::make_unique<GarbageCollector>();
+        impl->heap = impl->owned_heap.get();
     }
 
     Data::~Data()
     {
         impl->symbol_table.clear();
+        impl->globals.clear();
+        impl->global_slots.clear();
         if(impl->parent == nullptr)
         {
-            GarbageCollector::collect_garbage(impl);
+            impl->heap->collect_garbage(impl);
         }
         delete impl;
     }
 
     Result Data::do_string(const std::string& string)
     {
-        auto[tokens, tok_error] = tokenize_string(string, string);
-        if(tok_error)
-        {
-            std::stringstream ss;
-            ss << COLOR_RED << tok_error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
-        }
-
-        Parser parser;
-        auto[ast, parse_error] = parser.parse_tokens(tokens);
-        if(parse_error)
+        BytecodeGenerator::Result bytecode;
+        std::optional<std::string> error = compile(string, string, impl, bytecode);
+        if(!error)
         {
-            std::stringstream ss;
-            ss << COLOR_RED << parse_error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
+            std::cout << bytecode.bytecode;
+            error = run_main_chunk(bytecode.bytecode, impl);
         }
-
-        BytecodeGenerator byte_gen;
-        auto bytecode = byte_gen.generate_bytecode(ast);
-        if(bytecode.error)
-        {
-            std::stringstream ss;
-            ss << COLOR_RED << bytecode.error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
-        }
-        std::cout << bytecode.bytecode;
-        VirtualMachine vm;
-        std::optional<std::string> error = vm.run_bytecode(bytecode.bytecode, impl);
         if(error)
         {
-            std::stringstream ss;
-            ss << COLOR_RED << error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
+            push_error(error.value(), impl);
             return Result::RUNTIME_ERROR;
         }
 
@@ -90,53 +142,27 @@ namespace sourdo
 
         file.close();
 
-        auto[tokens, tok_error] = tokenize_string(file_text.str(), file_path);
-        if(tok_error)
-        {
-            std::stringstream ss;
-            ss << COLOR_RED << tok_error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
-        }
-
-        Parser parser;
-        auto[ast, parse_error] = parser.parse_tokens(tokens);
-        if(parse_error)
+        BytecodeGenerator::Result bytecode;
+        std::optional<std::string> error = compile(file_text.str(), file_path, impl, bytecode);
+        if(!error)
         {
-            std::stringstream ss;
-            ss << COLOR_RED << parse_error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
+            error = run_main_chunk(bytecode.bytecode, impl);
         }
-
-        BytecodeGenerator byte_gen;
-        auto bytecode = byte_gen.generate_bytecode(ast);
-        if(bytecode.error)
-        {
-            std::stringstream ss;
-            ss << COLOR_RED << bytecode.error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
-            return Result::RUNTIME_ERROR;
-        }
-        VirtualMachine vm;
-        std::optional<std::string> error = vm.run_bytecode(bytecode.bytecode, impl);
         if(error)
         {
-            std::stringstream ss;
-            ss << COLOR_RED << error.value() << COLOR_DEFAULT << std::flush;
-            push_string(ss.str());
+            push_error(error.value(), impl);
             return Result::RUNTIME_ERROR;
         }
 
         return Result::SUCCESS;
     }
     
-    void* Data::create_cpp_object(size_t size)
+    void* Data::create_cpp_object(size_t size, CppObjectFinalizer finalizer)
     {
-        //CppObject* cpp_object = new CppObject(size);
-        //impl->stack.push_back(cpp_object);
-        //return cpp_object->block;
-        return nullptr;
+        CppObject* cpp_object = new(*impl->heap) CppObject(*impl->heap, nullptr, size, finalizer);
+        impl->stack.emplace_back(cpp_object);
+        impl->heap->collect_if_needed(impl);
+        return cpp_object->block;
     }
     
     void* Data::check_cpp_object(int index, const std::string& name)
@@ -144,7 +170,7 @@ namespace sourdo
         Value& value = impl->index_stack(index);
         if(value.get_type() == ValueType::CPP_OBJECT)
         {
-            if(check_value_type(value, name))
+            if(check_value_type(value, impl->heap->type_id(name), *impl->heap))
             {
                 return value.to_cpp_object()->block;
             }
@@ -159,7 +185,7 @@ namespace sourdo
         Value& value = impl->index_stack(index);
         if(value.get_type() == ValueType::CPP_OBJECT)
         {
-            if(check_value_type(value, name))
+            if(check_value_type(value, impl->heap->type_id(name), *impl->heap))
             {
                 return value.to_cpp_object()->block;
             }
@@ -178,44 +204,59 @@ namespace sourdo
 
         if(value.get_type() == ValueType::OBJECT || value.get_type() == ValueType::SOURDO_FUNCTION)
         {
-            GCRef ref;
-            auto it = std::find(GlobalData::references.begin(), GlobalData::references.end(), Null());
-            if(it == GlobalData::references.end())
-            {
-                ref = GlobalData::references.size();
-                GlobalData::references.emplace_back(value);
-                return ref;
-            }
-            *it = value;
-            return it - GlobalData::references.begin();
+            return impl->heap->create_ref(value, false);
         }
         // Invalid reference instead of error
         return -1;
     }
 
+    GCRef Data::create_weak_ref(int index)
+    {
+        Value& value = impl->index_stack(index);
+
+        if(value.get_type() == ValueType::OBJECT || value.get_type() == ValueType::SOURDO_FUNCTION)
+        {
+            return impl->heap->create_ref(value, true);
+        }
+        return -1;
+    }
+
     void Data::remove_ref(GCRef ref)
     {
-        assert(ref >= 0);
-        assert(ref < GlobalData::references.size());
+        impl->heap->remove_ref(ref);
     }
 
     void Data::push_ref(GCRef ref)
     {
-        assert(ref >= 0);
-        assert(ref < GlobalData::references.size());
-
-        impl->stack.emplace_back(GlobalData::references[ref]);
+        const Value* value = impl->heap->find_ref(ref);
+        if(value == nullptr)
+        {
+            throw SourDoError("Invalid GCRef");
+        }
+        impl->stack.emplace_back(*value);
     }
 
     bool Data::is_ref_valid(GCRef ref)
     {
-        return ref >= 0 && ref < GlobalData::references.size();
+        return impl->heap->find_ref(ref) != nullptr;
     }
 
     void Data::create_table()
     {
-        impl->stack.emplace_back(new Table());
-        GarbageCollector::collect_garbage(impl);
+        impl->stack.emplace_back(new(*impl->heap) Table(*impl->heap));
+        impl->heap->collect_if_needed(impl);
+    }
+
+    void Data::set_table_weakness(int index, bool weak_keys, bool weak_values)
+    {
+        Value& value = impl->index_stack(index);
+        if(value.get_type() != ValueType::TABLE)
+        {
+            std::stringstream ss;
+            ss << COLOR_RED << "Value at the given index is not a table" << COLOR_DEFAULT << std::flush;
+            throw SourDoError(ss.str());
+        }
+        impl->heap->set_weakness(value.to_table(), weak_keys, weak_values);
     }
 
     Result Data::table_set(int object_index, bool protected_mode_enabled)
@@ -237,7 +278,7 @@ namespace sourdo
         Value key = impl->index_stack(-1);
         impl->stack.pop_back();
 
-        if(key.get_type() == ValueType::STRING && key.to_string() == "__prototype"
+        if(key.get_type() == ValueType::STRING && key.to_string()->text == "__prototype"
                 && (new_value.get_type() != ValueType::OBJECT || new_value.get_type() != ValueType::_NULL))
         {
             std::stringstream ss;
@@ -250,7 +291,10 @@ namespace sourdo
             throw SourDoError(ss.str());
         }
         
+        impl->heap->snapshot_barrier(obj);
         obj.to_table()->keys[key] = new_value;
+        impl->heap->write_barrier(obj, key);
+        impl->heap->write_barrier(obj, new_value);
         return Result::SUCCESS;
     }
 
@@ -319,37 +363,37 @@ namespace sourdo
         {
             return "";
         }
-        return value.to_string();
+        return value.to_string()->text;
     }
 
     void Data::push_number(Number value)
     {
         impl->stack.emplace_back(value);
-        GarbageCollector::collect_garbage(impl);
+        impl->heap->collect_if_needed(impl);
     }
 
     void Data::push_bool(bool value)
     {
         impl->stack.emplace_back(bool(value));
-        GarbageCollector::collect_garbage(impl);
+        impl->heap->collect_if_needed(impl);
     }
 
     void Data::push_string(const std::string& value)
     {
-        impl->stack.emplace_back(value);
-        GarbageCollector::collect_garbage(impl);
+        impl->stack.emplace_back(impl->heap->create_string(value));
+        impl->heap->collect_if_needed(impl);
     }
 
     void Data::push_cppfunction(const CppFunction& value)
     {
         impl->stack.emplace_back(value);
-        GarbageCollector::collect_garbage(impl);
+        impl->heap->collect_if_needed(impl);
     }
 
     void Data::push_null()
     {
         impl->stack.emplace_back(Null());
-        GarbageCollector::collect_garbage(impl);
+        impl->heap->collect_if_needed(impl);
     }
 
     Result Data::call_function(uint32_t arg_count, bool protected_mode_enabled)
@@ -366,22 +410,17 @@ namespace sourdo
             }
             throw SourDoError(ss.str());
         }
+        // The arguments stay where they are and become the bottom of the callee's stack.
         remove(-arg_count - 1);
-        std::vector<Value> args;
-        args.reserve(arg_count);
-
-        for(int i = -arg_count; i < 0; i++)
-        {
-            args.emplace_back(impl->index_stack(i));
-            remove(i);
-        }
+        Data::Impl* root = impl->get_root();
         
         if(func.get_type() == ValueType::SOURDO_FUNCTION)
         {
             
             SourDoFunction* func_value = func.to_sourdo_function();
-            if(args.size() != func_value->parameter_count)
+            if(arg_count != func_value->parameter_count)
             {
+                impl->stack.resize(impl->stack.size() - arg_count);
                 std::stringstream ss;
                 ss << COLOR_RED << "Function being called expected " << func_value->parameter_count; 
                 
@@ -394,9 +433,9 @@ namespace sourdo
                     ss << " arguments but ";
                 }
 
-                ss << args.size();
+                ss << arg_count;
 
-                if(args.size() == 1)
+                if(arg_count == 1)
                 {
                     ss << " was given";
                 }
@@ -413,37 +452,34 @@ namespace sourdo
                 throw SourDoError(ss.str());
             }
 
-            Data func_scope;
-            func_scope.get_impl()->parent = impl;
-            for(int i = 0; i < func_value->parameter_count; i++)
-            {
-                func_scope.get_impl()->stack.emplace_back(args[i]);
-            }
+            size_t scope_depth = root->scopes_in_use;
+            Data& func_scope = root->push_scope(impl, arg_count);
             VirtualMachine vm;
-            vm.run_bytecode(func_value->bytecode, func_scope.get_impl());
+            vm.run_frame(func_value->bytecode, func_scope.get_impl(), 0, true);
+            root->pop_scopes(scope_depth);
         }
         else
         {
-            Data func_scope;
-            func_scope.get_impl()->parent = impl;
-            for(int i = 0; i < args.size(); i++)
-            {
-                func_scope.get_impl()->stack.emplace_back(args[i]);
-            }
+            size_t scope_depth = root->scopes_in_use;
+            Data& func_scope = root->push_scope(impl, arg_count);
             CppFunction func_value = func.to_cpp_function();
             try
             {
                 if(func_value(func_scope))
                 {
-                    impl->stack.emplace_back(func_scope.impl->index_stack(-1));
+                    Value result = func_scope.impl->index_stack(-1);
+                    root->pop_scopes(scope_depth);
+                    impl->stack.emplace_back(result);
                 }
                 else
                 {
+                    root->pop_scopes(scope_depth);
                     push_null();
                 }
             }
             catch(const SourDoError& error)
             {
+                root->pop_scopes(scope_depth);
                 if(protected_mode_enabled)
                 {
                     push_string(error.what());
@@ -455,6 +491,11 @@ namespace sourdo
         return Result::SUCCESS;
     }
 
+    void Data::set_max_call_depth(uint32_t max_depth)
+    {
+        impl->get_root()->max_call_depth = max_depth;
+    }
+
     uint32_t Data::get_sourdo_func_param_count(int index)
     {
         Value& value = impl->index_stack(index);
@@ -467,17 +508,17 @@ namespace sourdo
 
     void Data::create_value(const std::string& name)
     {
-        impl->symbol_table[name].val = Null();
+        impl->create_symbol(impl->heap->intern_string(name)).val = Null();
     }
 
     void Data::create_constant(const std::string& name)
     {
-        impl->symbol_table[name] = {true, Null()};
+        impl->create_symbol(impl->heap->intern_string(name)) = {true, Null()};
     }
 
     Result Data::get_value(const std::string& name, bool protected_mode_enabled)
     {
-        std::optional<Value> value = impl->get_symbol(name);
+        std::optional<Value> value = impl->get_symbol(impl->heap->intern_string(name));
         if(!value)
         {
             std::stringstream ss;
@@ -496,9 +537,9 @@ namespace sourdo
 
     Result Data::set_value(const std::string& name, bool protected_mode_enabled)
     {
-        SetSymbolResult result = impl->set_symbol(name, impl->index_stack(-1));
+        SetSymbolResult result = impl->set_symbol(impl->heap->intern_string(name), impl->index_stack(-1));
         pop();
-        GarbageCollector::collect_garbage(impl);
+        impl->heap->collect_if_needed(impl);
         switch(result)
         {
             case SetSymbolResult::SYM_NOT_FOUND:
@@ -560,4 +601,64 @@ namespace sourdo
     {
         throw SourDoError(message);
     }
+
+    void Data::collect_garbage()
+    {
+        impl->heap->collect_garbage(impl);
+    }
+
+    void Data::set_gc_params(float growth_factor, size_t minimum_threshold)
+    {
+        impl->heap->set_params(growth_factor, minimum_threshold);
+    }
+
+    void Data::set_nursery_size(size_t size)
+    {
+        impl->heap->set_nursery_size(size);
+    }
+
+    void Data::set_gc_step(size_t step_size, size_t work_per_step)
+    {
+        impl->heap->set_step(step_size, work_per_step);
+    }
+
+    void Data::set_concurrent_marking(bool enabled)
+    {
+        impl->heap->set_concurrent_marking(enabled);
+    }
+
+    size_t Data::run_finalizers(size_t max_count)
+    {
+        return impl->heap->run_finalizers(max_count);
+    }
+
+    size_t Data::get_memory_usage()
+    {
+        return impl->heap->get_memory_usage();
+    }
+
+    void Data::set_memory_limits(size_t soft_limit, size_t hard_limit)
+    {
+        impl->heap->set_memory_limits(soft_limit, hard_limit);
+    }
+
+    GCPauseHistogram Data::get_gc_pause_histogram()
+    {
+        return impl->heap->pauses;
+    }
+
+    void Data::reset_gc_pause_histogram()
+    {
+        impl->heap->pauses = GCPauseHistogram();
+    }
+
+    InlineCacheStats Data::get_inline_cache_stats()
+    {
+        return impl->get_root()->inline_cache_stats;
+    }
+
+    void Data::reset_inline_cache_stats()
+    {
+        impl->get_root()->inline_cache_stats = {};
+    }
 } // namespace sourdo
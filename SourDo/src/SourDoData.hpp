@@ -4,12 +4,17 @@
 
 #include <vector>
 #include <optional>
-#include <map>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <cassert>
 #include <sstream>
 
 #include "Datatypes/Value.hpp"
 
 namespace sourdo {
+    class GarbageCollector;
+
     struct Symbol
     {
         Symbol()
@@ -31,57 +36,194 @@ namespace sourdo {
         SYM_READONLY,
     };
 
+    /* The part of a state's value stack that belongs to one scope, from 'base' to the top.
+     * Scopes are left in the reverse order they were entered, so only the innermost one grows or shrinks the stack.
+     */
+    class StackWindow
+    {
+    public:
+        using iterator = std::vector<Value>::iterator;
+
+        StackWindow(std::vector<Value>* values)
+            : values(values)
+        {
+        }
+
+        std::vector<Value>* values;
+        size_t base = 0;
+
+        size_t size() const { return values->size() - base; }
+        bool empty() const { return values->size() == base; }
+        Value& operator[](size_t index) { return (*values)[base + index]; }
+        Value& back() { return values->back(); }
+        iterator begin() { return values->begin() + base; }
+        iterator end() { return values->end(); }
+
+        template<typename T>
+        void emplace_back(T&& value) { values->emplace_back(std::forward<T>(value)); }
+        void push_back(const Value& value) { values->push_back(value); }
+        void pop_back() { values->pop_back(); }
+        void resize(size_t size) { values->resize(base + size); }
+        void clear() { values->resize(base); }
+        iterator erase(iterator position) { return values->erase(position); }
+        iterator erase(iterator first, iterator last) { return values->erase(first, last); }
+    };
+
     class Data::Impl
     {
     public:
+        // Owned by the root scope, and destroyed last so that objects outlive everything that refers to them.
+        std::unique_ptr<GarbageCollector> owned_heap;
+        // The heap of the state this scope belongs to.
+        GarbageCollector* heap = nullptr;
+
         Data::Impl* parent = nullptr;
 
+        // Every scope of a state shares the value stack of the root scope.
+        std::vector<Value> stack_values;
         // Used to keep temporary values.
-        std::vector<Value> stack;
-        // Used to store named values.
-        std::map<std::string, Symbol> symbol_table;
+        StackWindow stack{&stack_values};
+
+        // Owned by the root scope. Blocks and calls borrow their scopes from here, so entering one doesn't allocate.
+        std::vector<std::unique_ptr<Data>> scope_pool;
+        size_t scopes_in_use = 0;
+        // Owned by the root scope. Function calls that are running, across every VM working on the state.
+        uint64_t call_depth = 0;
+        uint64_t max_call_depth = 100000;
+        // Owned by the root scope. Counted by every VM working on the state.
+        InlineCacheStats inline_cache_stats;
+        // Used to store named values. Names are interned strings, so they are looked up by their address.
+        std::unordered_map<String*, Symbol> symbol_table;
 
-        SetSymbolResult set_symbol(const std::string& index, const Value& value)
+        // The root scope keeps its symbols (the globals) in a flat array instead, so
+        // instructions can cache the slot of the global they access.
+        std::vector<Symbol> globals;
+        std::unordered_map<String*, uint64_t> global_slots;
+        // Restamped whenever a global is created, which invalidates every cached slot.
+        // Stamps are unique across states, so a cache filled by one state never matches another.
+        uint64_t globals_version = ++version_counter;
+        static inline std::atomic<uint64_t> version_counter = 0;
+
+        // Looks up a symbol in this scope only.
+        Symbol* find_symbol(String* index)
         {
-            if(symbol_table.find(index) == symbol_table.end())
+            if(parent == nullptr)
             {
-                Data::Impl* current_parent = parent;
-                while(current_parent != nullptr)
-                {
-                    if(current_parent->symbol_table.find(index) != parent->symbol_table.end())
-                    {
-                        if(symbol_table[index].readonly)
-                        {
-                            return SetSymbolResult::SYM_READONLY;
-                        }
-                        current_parent->symbol_table[index].val = value;
+                auto it = global_slots.find(index);
+                return it != global_slots.end() ? &globals[it->second] : nullptr;
+            }
+            auto it = symbol_table.find(index);
+            return it != symbol_table.end() ? &it->second : nullptr;
+        }
 
-                        return SetSymbolResult::SUCCESS;
-                    }
-                    current_parent = parent->parent;
+        // Returns the symbol in this scope, creating it if it doesn't exist.
+        Symbol& create_symbol(String* index)
+        {
+            if(parent == nullptr)
+            {
+                auto it = global_slots.find(index);
+                if(it != global_slots.end())
+                {
+                    return globals[it->second];
                 }
-                return SetSymbolResult::SYM_NOT_FOUND;
+                global_slots.emplace(index, globals.size());
+                globals_version = ++version_counter;
+                return globals.emplace_back();
             }
-            if(symbol_table[index].readonly)
+            return symbol_table[index];
+        }
+
+        Data::Impl* get_root()
+        {
+            Data::Impl* root = this;
+            while(root->parent != nullptr)
             {
-                return SetSymbolResult::SYM_READONLY;
+                root = root->parent;
             }
+            return root;
+        }
 
-            symbol_table[index].val = value;
-            return SetSymbolResult::SUCCESS;
+        /* Takes a scope from the pool of this root scope and enters it below 'parent'.
+         * The top 'arg_count' values of the parent become the first values of the new scope, without being copied.
+         */
+        Data& push_scope(Data::Impl* parent, size_t arg_count = 0)
+        {
+            assert(this->parent == nullptr);
+            if(scopes_in_use == scope_pool.size())
+            {
+                scope_pool.emplace_back(std::make_unique<Data>());
+                // Pooled scopes use the heap of their state.
+                scope_pool.back()->get_impl()->owned_heap.reset();
+            }
+            Data& scope = *scope_pool[scopes_in_use++];
+            Data::Impl* scope_impl = scope.get_impl();
+            scope_impl->parent = parent;
+            scope_impl->heap = heap;
+            scope_impl->stack.values = parent->stack.values;
+            scope_impl->stack.base = parent->stack.values->size() - arg_count;
+            return scope;
+        }
+
+        // Leaves the innermost pooled scope, dropping its values and symbols.
+        void pop_scope()
+        {
+            Data::Impl* scope_impl = scope_pool[--scopes_in_use]->get_impl();
+            scope_impl->symbol_table.clear();
+            scope_impl->stack.clear();
+        }
+
+        // Leaves pooled scopes until only 'count' are in use. Used to unwind after a runtime error.
+        void pop_scopes(size_t count)
+        {
+            while(scopes_in_use > count)
+            {
+                pop_scope();
+            }
+        }
+
+        std::optional<uint64_t> find_global_slot(String* index)
+        {
+            auto it = global_slots.find(index);
+            if(it != global_slots.end())
+            {
+                return it->second;
+            }
+            return {};
+        }
+
+        SetSymbolResult set_symbol(String* index, const Value& value)
+        {
+            Data::Impl* current_scope = this;
+            while(current_scope != nullptr)
+            {
+                Symbol* symbol = current_scope->find_symbol(index);
+                if(symbol != nullptr)
+                {
+                    if(symbol->readonly)
+                    {
+                        return SetSymbolResult::SYM_READONLY;
+                    }
+                    symbol->val = value;
+                    return SetSymbolResult::SUCCESS;
+                }
+                current_scope = current_scope->parent;
+            }
+            return SetSymbolResult::SYM_NOT_FOUND;
         }
 
-        std::optional<Value> get_symbol(const std::string& index)
+        std::optional<Value> get_symbol(String* index)
         {
-            if(symbol_table.find(index) == symbol_table.end())
+            Data::Impl* current_scope = this;
+            while(current_scope != nullptr)
             {
-                if(parent)
+                Symbol* symbol = current_scope->find_symbol(index);
+                if(symbol != nullptr)
                 {
-                    return parent->get_symbol(index);
+                    return symbol->val;
                 }
-                return {};
+                current_scope = current_scope->parent;
             }
-            return symbol_table[index].val;
+            return {};
         }
 
         Value& index_stack(int index)
@@ -213,6 +213,16 @@ namespace sourdo
         return false;
     }
 
+    bool set_weak(Data& data)
+    {
+        check_arg_count(data, 3);
+        check_is_table(data, 1);
+        check_is_bool(data, 2);
+        check_is_bool(data, 3);
+        data.set_table_weakness(1, data.value_to_bool(2), data.value_to_bool(3));
+        return false;
+    }
+
     void load_lib_basic(Data& data)
     {
         data.create_value("print");
@@ -234,5 +244,9 @@ namespace sourdo
         data.create_value("assert");
         data.push_cppfunction(assert_func);
         data.set_value("assert", true);
+
+        data.create_value("set_weak");
+        data.push_cppfunction(set_weak);
+        data.set_value("set_weak", true);
     }
 } // namespace sourdo
@@ -4,6 +4,16 @@ workspace("OrbitEngine")
 
 outputdir = "%{cfg.system}/%{cfg.buildcfg}-%{cfg.architecture}"
 
+newoption({
+    trigger = "compact-values",
+    description = "Store SourDo values as a 16 byte tag and payload instead of a std::variant",
+})
+
+newoption({
+    trigger = "computed-goto",
+    description = "Dispatch bytecode with computed gotos instead of a switch statement (GCC and Clang only)",
+})
+
 project("SourDo")
     kind("StaticLib")
     language("C++")
@@ -37,6 +47,12 @@ project("SourDo")
         runtime("Release")
         optimize("On")
 
+    filter("options:compact-values")
+        defines({"SOURDO_COMPACT_VALUE"})
+
+    filter("options:computed-goto")
+        defines({"SOURDO_COMPUTED_GOTO"})
+
 project("Sandbox")
     kind("ConsoleApp")
     language("C++")
@@ -58,6 +74,9 @@ project("Sandbox")
     links({
         "SourDo"
     })
+
+    filter("system:linux")
+        links({"pthread"})
     
     filter("configurations:Debug")
         runtime("Debug")